@@ -1,5 +1,6 @@
 #include "boost/asio.hpp"
 #include "deserializer.h"
+#include "io_pool.h"
 #include "mainwindow.h"
 #include "network.h"
 #include "network_types.h"
@@ -7,19 +8,42 @@
 #include "tcpserver.h"
 #include "thread_safe_structures.h"
 #include <QApplication>
+#include <cstdlib>
 #include <iostream>
+#include <string>
+#include <thread>
+
+// --threads=N, then MESSENGER_THREADS, then one shard per core
+unsigned io_thread_count(int argc, char *argv[]) {
+  unsigned count = std::thread::hardware_concurrency();
+  if (const char *env = std::getenv("MESSENGER_THREADS")) {
+    count = std::strtoul(env, nullptr, 10);
+  }
+  const std::string flag = "--threads=";
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]).rfind(flag, 0) == 0) {
+      count = std::strtoul(argv[i] + flag.size(), nullptr, 10);
+    }
+  }
+  return count > 0 ? count : 1;
+}
 
 int main(int argc, char *argv[]) {
   
   QApplication a(argc, argv);
 
   thread_safe_map<std::string, std::pair<std::string, char>> address_from_id;
-  thread_safe_map<std::string, CryptoPP::RSA::PublicKey> RSA_key_from_id;
-  thread_safe_map<std::string, std::string> id_from_rsa_hex;
-  std::pair<std::map<std::string, messenger::chat>, std::mutex> chat_list;
-  std::pair<std::map<std::string, messenger::paxos>, std::mutex> paxos_list;
+  messenger::network::endpoint_cache endpoint_from_id;
+  thread_safe_map<std::string, digital_signature::fingerprinted_key>
+      RSA_key_from_id;
+  thread_safe_map<digital_signature::key_fingerprint, std::string>
+      id_from_fingerprint;
+  messenger::network::chat_registry chat_list;
+  messenger::network::paxos_registry paxos_list;
 
-  boost::asio::io_context io;
+  // declared before the shards, pending reads free into it on shutdown
+  messenger::network::frame_pool frames;
+  messenger::network::io_pool shards(io_thread_count(argc, argv));
   auto keys = key_exchange::generate_key();
   std::cout << key_exchange::key_to_hex(keys.first) << "<- ";
   CryptoPP::RSA::PrivateKey sign_privateKey = keys.second;
@@ -27,20 +51,19 @@ int main(int argc, char *argv[]) {
 
 
   messenger::network::messenger_server serv(
-      40000, chat_list, paxos_list, address_from_id,
+      40000, chat_list, paxos_list, address_from_id, endpoint_from_id, frames,
       sign_privateKey,
-      sign_publicKey, io);
+      sign_publicKey, shards);
 
   MainWindow w;
   w.setWindowTitle("FFLC");
   w.show();
 
   serv.dialog_text_handler =
-      [&w,
-       &id_from_rsa_hex](messenger::network_packets::dialog_text id_and_text) {
-        id_and_text.id;
-        std::string key_str =
-            id_from_rsa_hex.get(key_exchange::key_to_hex(id_and_text.id));
+      [&w, &id_from_fingerprint](
+          messenger::network_packets::dialog_text id_and_text,
+          digital_signature::key_fingerprint sender) {
+        std::string key_str = id_from_fingerprint.get(sender);
         bool already_exist = false;
         for (int i = 0; i < w.get_list()->count(); i++) {
           if (w.get_list()->item(i)->text().toStdString() == key_str) {
@@ -61,11 +84,13 @@ int main(int argc, char *argv[]) {
   QObject::connect(
       &w, &MainWindow::button_send,
       [serv = &serv, &RSA_key_from_id](std::string id, std::string text) {
-        auto key = RSA_key_from_id.get(id);
-        std::string s = key_exchange::key_to_hex(key);
-
+        auto found = RSA_key_from_id.find(id);
+        if (!found) {
+          std::cout << "unknown contact " << id << std::endl;
+          return;
+        }
         messenger::network::send_dialog_msg(serv, id, text, serv->keys.first,
-                                            serv->keys.second, key,
+                                            serv->keys.second, found->id,
                                             [](boost::system::error_code ec) {
                                               std::string error(ec.message());
                                               std::cout << ec.message();
@@ -75,22 +100,22 @@ int main(int argc, char *argv[]) {
 
   QObject::connect(
       &w, &MainWindow::button_close_addition,
-      [&address_from_id, &RSA_key_from_id, &id_from_rsa_hex](
+      [&address_from_id, &endpoint_from_id, &RSA_key_from_id,
+       &id_from_fingerprint](
           std::string name, std::string public_key, std::string ip_address) {
         std::cout << name << " " << public_key << " " << ip_address
                   << std::endl;
         address_from_id.add(name, std::pair{std::string(ip_address), (char)0});
-        RSA_key_from_id.add(
-            name,
+        endpoint_from_id.add(name, ip_address);
+        // the fingerprint is computed once here, messages only compare it
+        digital_signature::fingerprinted_key key(
             key_exchange::hex_to_key<CryptoPP::RSA::PublicKey>(public_key));
-        id_from_rsa_hex.add(public_key, name);
+        id_from_fingerprint.add(key.id, name);
+        RSA_key_from_id.add(name, std::move(key));
       });
 
-  std::thread thr1([&io]() { io.run(); });
-  std::thread thr2([&io]() { io.run(); });
-  std::thread thr3([&io]() { io.run(); });
+  shards.run();
   a.exec();
-  thr1.join();
-  thr2.join();
-  thr3.join();
+  shards.stop();
+  shards.join();
 }
@@ -1,73 +1,161 @@
 #ifndef CHAT_H
 #define CHAT_H
 
+#include "boost/asio.hpp"
+#include "cryptopp/sha.h"
+#include <array>
 #include <iostream>
 #include <map>
 #include <memory>
-#include <mutex>
+#include <optional>
 #include <string>
 #include <vector>
 
+#include "chat_history.h"
+#include "merkle_tree.h"
 #include "paxos_fwd.h"
 
 namespace messenger {
 
-enum chat_event_types {
-  chat_text_type = 1,
-  chat_new_user_type = 2,
-  transfer_type = 3
-};
-
-class chat_event {
-public:
-  char event_type = 0;
-  std::string initiator;
-  uint64_t time = 0;
-  virtual ~chat_event() {}
-};
+// SHA-256 chain over the history: digest of n events is
+// SHA256(digest of n - 1 events, event n)
+using chat_digest = merkle_tree::digest;
 
-class chat_text : public chat_event {
+class chat {
 public:
-  std::string text;
-};
+  using strand_type =
+      boost::asio::strand<boost::asio::io_context::executor_type>;
 
-class chat_new_user : public chat_event {
-public:
-  std::string new_user_id;
-};
+  chat(boost::asio::io_context &io, std::string m_id, std::string c_id)
+      : strand_d(boost::asio::make_strand(io)), chat_id_s(c_id), my_id(m_id) {}
 
-class transfer : public chat_event {
-public:
-  uint32_t amount = 0;
-  std::string recipient;
-};
+  // every member except chat_id and get_my_id must run on this strand, the
+  // chat's paxos instance shares it
+  strand_type &get_strand() { return strand_d; }
 
-class chat {
-public:
-  chat(std::string m_id, std::string c_id) : my_id(m_id), chat_id_s(c_id) {}
-
-  std::shared_ptr<chat_event> get(uint64_t i) {
-    std::unique_lock ul{locker};
+  // views stay valid until the event is truncated, to_event() copies it
+  std::optional<chat_event_view> get(uint64_t i) {
     if (i >= history.size()) {
-      return nullptr;
+      return std::nullopt;
     }
     return history[i];
   }
 
+  uint64_t size() {
+    return history.size();
+  }
+
   void add(std::shared_ptr<chat_event> c_event) {
-    std::unique_lock ul{locker};
-    history.emplace_back(::std::move(c_event));
+    prefix_digests.push_back(chain(prefix_digests.back(), *c_event));
+    history.push_back(*c_event);
+    extend_tree();
     std::cout << __LINE__ << "chat add" << '\n';
   }
-  void clear() {
-    std::unique_lock ul{locker};
-    history.clear();
+
+  void add(std::vector<std::shared_ptr<chat_event>> c_events) {
+    for (auto &i : c_events) {
+      prefix_digests.push_back(chain(prefix_digests.back(), *i));
+      history.push_back(*i);
+    }
+    extend_tree();
+  }
+
+  // replaces history[index, ...) with c_events, false if index is past the end
+  bool add(uint64_t index, std::vector<std::shared_ptr<chat_event>> c_events) {
+    if (index > history.size()) {
+      return false;
+    }
+    truncate(index);
+    for (auto &i : c_events) {
+      prefix_digests.push_back(chain(prefix_digests.back(), *i));
+      history.push_back(*i);
+    }
+    extend_tree();
+    return true;
+  }
+
+  void clear() { truncate(0); }
+
+  // drops every event from index len on
+  void truncate(uint64_t len) {
+    if (len < history.size()) {
+      history.truncate(len);
+      prefix_digests.resize(len + 1);
+      tree.truncate(len / merkle_block);
+    }
+  }
+
+  // hash of the first len events, empty if the history is shorter
+  std::string history_hash(uint64_t len) {
+    if (len >= prefix_digests.size()) {
+      return "";
+    }
+    return to_hex(prefix_digests[len]);
+  }
+
+  chat_digest digest() {
+    return prefix_digests.back();
   }
 
+  // hash the history would have after c_event is added
   std::string new_hash(::std::shared_ptr<chat_event> c_event) {
-    return ::std::to_string(history.size() + 1);
+    return to_hex(chain(prefix_digests.back(), *c_event));
+  }
+  std::string hash() { return to_hex(digest()); }
+
+  // merkle tree over complete blocks of merkle_block events, leaf i hashes
+  // history[i * merkle_block, (i + 1) * merkle_block) without the prefix
+  static constexpr uint64_t merkle_block = 256;
+
+  uint64_t merkle_leaves() {
+    return tree.leaf_count();
+  }
+
+  std::optional<chat_digest> merkle_node(uint32_t level, uint64_t index) {
+    return tree.node(level, index);
+  }
+
+  static chat_digest chain(const chat_digest &prev,
+                           const chat_event_view &c_event) {
+    CryptoPP::SHA256 sha;
+    sha.Update(prev.data(), prev.size());
+    mix_event(sha, c_event);
+    chat_digest res;
+    sha.Final(res.data());
+    return res;
+  }
+
+  static void mix_event(CryptoPP::SHA256 &sha,
+                        const chat_event_view &c_event) {
+    auto mix = [&sha](const void *data, uint64_t len) {
+      sha.Update(static_cast<const CryptoPP::byte *>(data), len);
+    };
+    auto mix_str = [&mix](std::string_view str) {
+      uint64_t len = str.size();
+      mix(&len, sizeof(len));
+      mix(str.data(), len);
+    };
+    mix(&c_event.event_type, 1);
+    mix(&c_event.time, sizeof(c_event.time));
+    mix_str(c_event.initiator);
+    if (c_event.event_type == chat_text_type ||
+        c_event.event_type == chat_new_user_type) {
+      mix_str(c_event.body);
+    } else if (c_event.event_type == transfer_type) {
+      mix(&c_event.amount, sizeof(c_event.amount));
+      mix_str(c_event.body);
+    }
+  }
+
+  static std::string to_hex(const chat_digest &digest) {
+    static const char digits[] = "0123456789abcdef";
+    std::string res(2 * digest.size(), '0');
+    for (uint64_t i = 0; i < digest.size(); i++) {
+      res[2 * i] = digits[digest[i] >> 4];
+      res[2 * i + 1] = digits[digest[i] & 0xf];
+    }
+    return res;
   }
-  std::string hash() { return ::std::to_string(history.size()); }
 
   std::string chat_id() { return chat_id_s; }
 
@@ -76,8 +164,24 @@ public:
   friend paxos;
 
 private:
-  std::vector<::std::shared_ptr<chat_event>> history;
-  std::mutex locker;
+  // hashes every block completed since the last call
+  void extend_tree() {
+    while ((tree.leaf_count() + 1) * merkle_block <= history.size()) {
+      CryptoPP::SHA256 sha;
+      auto first = tree.leaf_count() * merkle_block;
+      for (auto i = first; i < first + merkle_block; i++) {
+        mix_event(sha, history[i]);
+      }
+      chat_digest leaf;
+      sha.Final(leaf.data());
+      tree.append_leaf(leaf);
+    }
+  }
+
+  chat_history history;
+  std::vector<chat_digest> prefix_digests{chat_digest{}};
+  merkle_tree tree;
+  strand_type strand_d;
   std::string chat_id_s;
   std::string my_id;
   // std::map<std::string, uint32_t> participants;
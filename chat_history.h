@@ -0,0 +1,197 @@
+#ifndef CHAT_HISTORY_H
+#define CHAT_HISTORY_H
+
+#include "id_interner.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace messenger {
+
+enum chat_event_types {
+  chat_text_type = 1,
+  chat_new_user_type = 2,
+  transfer_type = 3
+};
+
+class chat_event {
+public:
+  char event_type = 0;
+  std::string initiator;
+  uint64_t time = 0;
+  virtual ~chat_event() {}
+};
+
+class chat_text : public chat_event {
+public:
+  std::string text;
+};
+
+class chat_new_user : public chat_event {
+public:
+  std::string new_user_id;
+};
+
+class transfer : public chat_event {
+public:
+  uint32_t amount = 0;
+  std::string recipient;
+};
+
+// Non-owning view of an event. body is the text, the new user's id or the
+// transfer recipient depending on event_type.
+struct chat_event_view {
+  char event_type = 0;
+  uint64_t time = 0;
+  uint32_t amount = 0;
+  std::string_view initiator;
+  std::string_view body;
+
+  chat_event_view() = default;
+
+  chat_event_view(const chat_event &c_event)
+      : event_type(c_event.event_type), time(c_event.time),
+        initiator(c_event.initiator) {
+    if (event_type == chat_text_type) {
+      body = static_cast<const chat_text &>(c_event).text;
+    } else if (event_type == chat_new_user_type) {
+      body = static_cast<const chat_new_user &>(c_event).new_user_id;
+    } else if (event_type == transfer_type) {
+      auto &ev = static_cast<const transfer &>(c_event);
+      amount = ev.amount;
+      body = ev.recipient;
+    }
+  }
+
+  // owning copy, nullptr for unknown types
+  std::shared_ptr<chat_event> to_event() const {
+    std::shared_ptr<chat_event> res;
+    if (event_type == chat_text_type) {
+      auto ev = std::make_shared<chat_text>();
+      ev->text = body;
+      res = std::move(ev);
+    } else if (event_type == chat_new_user_type) {
+      auto ev = std::make_shared<chat_new_user>();
+      ev->new_user_id = body;
+      res = std::move(ev);
+    } else if (event_type == transfer_type) {
+      auto ev = std::make_shared<transfer>();
+      ev->amount = amount;
+      ev->recipient = body;
+      res = std::move(ev);
+    } else {
+      return nullptr;
+    }
+    res->event_type = event_type;
+    res->initiator = initiator;
+    res->time = time;
+    return res;
+  }
+};
+
+// Columnar event store: fixed-size headers in one array, bodies in an
+// append-only arena of blocks that never move. Initiators already interned
+// are kept as handles, others (e.g. taken from a peer's history chunk) are
+// stored in the arena in front of the body, so peers cannot grow the
+// process-wide id table. Views stay valid until their events are truncated.
+class chat_history {
+public:
+  static constexpr uint64_t block_size = 64 << 10;
+  // initiator field holds the length of an inline initiator
+  static constexpr id_handle inline_initiator = id_handle(1) << 31;
+
+  uint64_t size() const { return headers.size(); }
+
+  chat_event_view operator[](uint64_t i) const {
+    const auto &h = headers[i];
+    chat_event_view res;
+    res.event_type = h.event_type;
+    res.time = h.time;
+    res.amount = h.amount;
+    const char *data = blocks[h.block].data.get() + h.offset;
+    if (h.initiator & inline_initiator) {
+      uint32_t len = h.initiator & ~inline_initiator;
+      res.initiator = std::string_view(data, len);
+      data += len;
+    } else {
+      res.initiator = id_interner::global().name(h.initiator);
+    }
+    res.body = std::string_view(data, h.body_len);
+    return res;
+  }
+
+  void push_back(const chat_event_view &c_event) {
+    event_header h;
+    h.time = c_event.time;
+    h.amount = c_event.amount;
+    h.event_type = c_event.event_type;
+    h.body_len = c_event.body.size();
+    std::string_view stored; // initiator bytes kept in the arena
+    if (auto id = id_interner::global().find(c_event.initiator)) {
+      h.initiator = *id;
+    } else {
+      stored = c_event.initiator.substr(0, ~inline_initiator);
+      h.initiator = inline_initiator | id_handle(stored.size());
+    }
+    uint64_t len = stored.size() + h.body_len;
+    if (blocks.empty() || blocks.back().capacity - used < len) {
+      block b;
+      b.capacity = std::max<uint64_t>(block_size, len);
+      b.data.reset(new char[b.capacity]);
+      blocks.push_back(std::move(b));
+      used = 0;
+    }
+    h.block = blocks.size() - 1;
+    h.offset = used;
+    if (!stored.empty()) {
+      std::memcpy(blocks.back().data.get() + used, stored.data(),
+                  stored.size());
+      used += stored.size();
+    }
+    if (h.body_len != 0) {
+      std::memcpy(blocks.back().data.get() + used, c_event.body.data(),
+                  h.body_len);
+      used += h.body_len;
+    }
+    headers.push_back(h);
+  }
+
+  // drops events from len on and rewinds the arena to the first of them
+  void truncate(uint64_t len) {
+    if (len >= headers.size()) {
+      return;
+    }
+    const auto &h = headers[len];
+    blocks.resize(h.block + 1);
+    used = h.offset;
+    headers.resize(len);
+  }
+
+private:
+  struct event_header {
+    uint64_t time = 0;
+    uint32_t block = 0;
+    uint32_t offset = 0;
+    uint32_t body_len = 0;
+    id_handle initiator = 0;
+    uint32_t amount = 0;
+    char event_type = 0;
+  };
+
+  struct block {
+    std::unique_ptr<char[]> data;
+    uint64_t capacity = 0;
+  };
+
+  std::vector<event_header> headers;
+  std::vector<block> blocks;
+  uint64_t used = 0;
+};
+
+} // namespace messenger
+
+#endif
@@ -0,0 +1,338 @@
+#ifndef CONNECTION_POOL_H
+#define CONNECTION_POOL_H
+
+#include "boost/asio.hpp"
+#include "id_interner.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace messenger {
+namespace network {
+
+// Long-lived outgoing connections, one per peer. Packets to the same peer are
+// queued on the connection strand and written one after another, so frames
+// from different callers never interleave on the stream. Frames the peer
+// writes back are passed to the reply handler.
+class connection_pool {
+public:
+  using send_handler = std::function<void(const boost::system::error_code &)>;
+  using connect_handler = std::function<void(boost::asio::ip::tcp::socket,
+                                             boost::system::error_code)>;
+  using connector = std::function<void(connect_handler)>;
+  // io_context a peer's connection lives on
+  using io_selector =
+      std::function<boost::asio::io_context &(const std::string &)>;
+  // peer, frame without its length prefix
+  using reply_handler =
+      std::function<void(id_handle, std::shared_ptr<char[]>, uint64_t)>;
+
+  static constexpr uint64_t max_reply_len = 4096;
+
+  struct counters {
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> reconnects{0};
+    std::atomic<uint64_t> evictions{0};
+  };
+
+  connection_pool(boost::asio::io_context &io,
+                  std::chrono::seconds idle = std::chrono::seconds(60),
+                  uint32_t retries = 2,
+                  std::chrono::milliseconds backoff =
+                      std::chrono::milliseconds(100),
+                  io_selector selector = nullptr,
+                  reply_handler replies = nullptr)
+      : io_context(io), io_for(std::move(selector)),
+        on_reply(std::move(replies)), idle_timeout(idle),
+        max_retries(retries), retry_backoff(backoff), sweep_timer(io) {
+    schedule_sweep();
+  }
+
+  ~connection_pool() { sweep_timer.cancel(); }
+
+  // connect is used to (re)open the socket when there is no live connection
+  void async_send(id_handle id, std::shared_ptr<char[]> data, uint64_t len,
+                  connector connect, send_handler handler) {
+    std::shared_ptr<connection> conn;
+    {
+      std::unique_lock ul{locker};
+      auto &slot = connections[id];
+      if (slot != nullptr) {
+        stats.hits++;
+        conn = slot;
+      } else {
+        stats.misses++;
+        auto &io = io_for ? io_for(id_interner::global().name(id)) : io_context;
+        slot = std::make_shared<connection>(io, id, std::move(connect));
+        conn = slot;
+      }
+    }
+    boost::asio::post(conn->strand, [this, conn, data, len, handler]() {
+      // dropped after it was looked up, the map gets a new one
+      if (conn->dropped) {
+        async_send(conn->peer, data, len, conn->connect, handler);
+        return;
+      }
+      conn->queue.push_back(pending_write{data, len, handler, 0});
+      conn->last_used = std::chrono::steady_clock::now();
+      if (conn->state == connection_state::closed) {
+        open(conn);
+      } else if (conn->state == connection_state::open) {
+        write_next(conn);
+      }
+    });
+  }
+
+  const counters &get_stats() const { return stats; }
+
+  size_t size() {
+    std::unique_lock ul{locker};
+    return connections.size();
+  }
+
+private:
+  enum class connection_state { closed, connecting, open, writing };
+
+  struct pending_write {
+    std::shared_ptr<char[]> data;
+    uint64_t len = 0;
+    send_handler handler;
+    uint32_t attempt = 0;
+  };
+
+  struct connection {
+    connection(boost::asio::io_context &io, id_handle p, connector c)
+        : peer(p), sock(io), strand(boost::asio::make_strand(io)),
+          connect(std::move(c)), retry_timer(io) {}
+
+    id_handle peer;
+    boost::asio::ip::tcp::socket sock;
+    boost::asio::strand<boost::asio::io_context::executor_type> strand;
+    connector connect;
+    boost::asio::steady_timer retry_timer;
+    std::deque<pending_write> queue;
+    connection_state state = connection_state::closed;
+    bool dropped = false; // removed from the map, never reopened
+    uint64_t generation = 0; // bumped per socket, stale watches ignore it
+    uint32_t connect_attempts = 0;
+    uint64_t reply_len = 0;
+    std::chrono::steady_clock::time_point last_used =
+        std::chrono::steady_clock::now();
+  };
+
+  // runs on conn->strand
+  void open(std::shared_ptr<connection> conn) {
+    conn->state = connection_state::connecting;
+    conn->connect(
+        [this, conn](boost::asio::ip::tcp::socket sock,
+                     boost::system::error_code ec) {
+          auto sock_ptr =
+              std::make_shared<boost::asio::ip::tcp::socket>(std::move(sock));
+          boost::asio::post(conn->strand, [this, conn, sock_ptr, ec]() {
+            if (ec) {
+              retry_open(conn, ec);
+              return;
+            }
+            conn->sock = std::move(*sock_ptr);
+            boost::system::error_code opt_ec;
+            conn->sock.set_option(boost::asio::socket_base::keep_alive(true),
+                                  opt_ec);
+            conn->sock.set_option(boost::asio::ip::tcp::no_delay(true), opt_ec);
+            conn->connect_attempts = 0;
+            conn->state = connection_state::open;
+            conn->generation++;
+            watch(conn);
+            write_next(conn);
+          });
+        });
+  }
+
+  // runs on conn->strand
+  void retry_open(std::shared_ptr<connection> conn,
+                  boost::system::error_code ec) {
+    conn->state = connection_state::closed;
+    if (conn->connect_attempts++ < max_retries) {
+      stats.reconnects++;
+      conn->retry_timer.expires_after(retry_backoff * conn->connect_attempts);
+      conn->retry_timer.async_wait(boost::asio::bind_executor(
+          conn->strand, [this, conn](const boost::system::error_code &ec) {
+            if (!ec && conn->state == connection_state::closed) {
+              open(conn);
+            }
+          }));
+      return;
+    }
+    conn->connect_attempts = 0;
+    auto failed = std::move(conn->queue);
+    conn->queue.clear();
+    drop(conn);
+    for (auto &w : failed) {
+      w.handler(ec);
+    }
+  }
+
+  // reads replies and detects a peer that closed an idle connection. A
+  // pending write owns the reconnect, the watch only closes the socket under
+  // it.
+  void watch(std::shared_ptr<connection> conn) {
+    boost::asio::async_read(
+        conn->sock, boost::asio::buffer(&conn->reply_len, sizeof(uint64_t)),
+        boost::asio::bind_executor(
+            conn->strand, [this, conn, generation = conn->generation](
+                              const boost::system::error_code &ec, uint64_t) {
+              if (generation != conn->generation ||
+                  (conn->state != connection_state::open &&
+                   conn->state != connection_state::writing)) {
+                return;
+              }
+              if (ec || conn->reply_len > max_reply_len) {
+                lost(conn);
+                return;
+              }
+              read_reply(conn);
+            }));
+  }
+
+  void read_reply(std::shared_ptr<connection> conn) {
+    uint64_t len = conn->reply_len;
+    std::shared_ptr<char[]> data(new char[len]);
+    boost::asio::async_read(
+        conn->sock, boost::asio::buffer(data.get(), len),
+        boost::asio::bind_executor(
+            conn->strand,
+            [this, conn, data, len, generation = conn->generation](
+                const boost::system::error_code &ec, uint64_t) {
+              if (generation != conn->generation ||
+                  (conn->state != connection_state::open &&
+                   conn->state != connection_state::writing)) {
+                return;
+              }
+              if (ec) {
+                lost(conn);
+                return;
+              }
+              if (on_reply) {
+                on_reply(conn->peer, data, len);
+              }
+              watch(conn);
+            }));
+  }
+
+  // runs on conn->strand
+  void lost(std::shared_ptr<connection> conn) {
+    boost::system::error_code ignored;
+    conn->sock.close(ignored);
+    if (conn->state == connection_state::open) {
+      conn->state = connection_state::closed;
+      if (!conn->queue.empty()) {
+        open(conn);
+      }
+    }
+  }
+
+  // runs on conn->strand
+  void write_next(std::shared_ptr<connection> conn) {
+    if (conn->state != connection_state::open || conn->queue.empty()) {
+      return;
+    }
+    conn->state = connection_state::writing;
+    auto &front = conn->queue.front();
+    boost::asio::async_write(
+        conn->sock, boost::asio::buffer(front.data.get(), front.len),
+        boost::asio::bind_executor(
+            conn->strand,
+            [this, conn](const boost::system::error_code &ec, uint64_t) {
+              conn->last_used = std::chrono::steady_clock::now();
+              if (ec) {
+                boost::system::error_code ignored;
+                conn->sock.close(ignored);
+                conn->state = connection_state::closed;
+                auto &front = conn->queue.front();
+                if (front.attempt++ < max_retries) {
+                  stats.reconnects++;
+                  open(conn);
+                } else {
+                  auto handler = std::move(front.handler);
+                  conn->queue.pop_front();
+                  handler(ec);
+                  if (!conn->queue.empty()) {
+                    open(conn);
+                  }
+                }
+                return;
+              }
+              auto handler = std::move(conn->queue.front().handler);
+              conn->queue.pop_front();
+              if (!conn->sock.is_open()) { // closed by watch meanwhile
+                conn->state = connection_state::closed;
+                handler(ec);
+                if (!conn->queue.empty()) {
+                  open(conn);
+                }
+                return;
+              }
+              conn->state = connection_state::open;
+              handler(ec);
+              write_next(conn);
+            }));
+  }
+
+  // runs on conn->strand
+  void drop(std::shared_ptr<connection> conn) {
+    conn->dropped = true;
+    std::unique_lock ul{locker};
+    auto slot = connections.find(conn->peer);
+    if (slot != nullptr && *slot == conn) {
+      connections.erase(conn->peer);
+    }
+  }
+
+  void schedule_sweep() {
+    sweep_timer.expires_after(idle_timeout / 2);
+    sweep_timer.async_wait([this](const boost::system::error_code &ec) {
+      if (!ec) {
+        sweep();
+        schedule_sweep();
+      }
+    });
+  }
+
+  void sweep() {
+    std::unique_lock ul{locker};
+    connections.for_each([this](id_handle, std::shared_ptr<connection> conn) {
+      boost::asio::post(conn->strand, [this, conn]() {
+        if (conn->queue.empty() &&
+            conn->state == connection_state::open &&
+            std::chrono::steady_clock::now() - conn->last_used >
+                idle_timeout) {
+          stats.evictions++;
+          boost::system::error_code ignored;
+          conn->sock.close(ignored);
+          conn->state = connection_state::closed;
+          drop(conn);
+        }
+      });
+    });
+  }
+
+  boost::asio::io_context &io_context;
+  io_selector io_for;
+  reply_handler on_reply;
+  std::chrono::seconds idle_timeout;
+  uint32_t max_retries;
+  std::chrono::milliseconds retry_backoff;
+  boost::asio::steady_timer sweep_timer;
+  handle_map<std::shared_ptr<connection>> connections;
+  std::mutex locker;
+  counters stats;
+};
+
+} // namespace network
+} // namespace messenger
+
+#endif
@@ -73,8 +73,13 @@ void load_public_key(CryptoPP::RSA::PublicKey &public_key,
 }
 
 std::pair<CryptoPP::RSA::PublicKey, CryptoPP::RSA::PrivateKey> generate_key() {
+  return generate_key(key_exchange::prng);
+}
+
+std::pair<CryptoPP::RSA::PublicKey, CryptoPP::RSA::PrivateKey>
+generate_key(CryptoPP::RandomNumberGenerator &rng) {
   CryptoPP::InvertibleRSAFunction params;
-  params.GenerateRandomWithKeySize(key_exchange::prng, 3072);
+  params.GenerateRandomWithKeySize(rng, 3072);
   CryptoPP::RSA::PrivateKey private_key(params);
   CryptoPP::RSA::PublicKey public_key(params);
   return std::make_pair(public_key, private_key);
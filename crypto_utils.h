@@ -12,6 +12,9 @@
 #include "cryptopp/salsa.h"
 #include "cryptopp/secblock.h"
 #include "cryptopp/sha.h"
+#include <array>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <string>
 
@@ -73,14 +76,66 @@ auto bytes_to_rsa_key(const unsigned char *key, int64_t size) {
   return rsa_key;
 }
 
+// SHA-256 of a key's DER encoding, compared and hashed instead of the key
+struct key_fingerprint {
+  std::array<CryptoPP::byte, CryptoPP::SHA256::DIGESTSIZE> digest{};
+
+  bool operator==(const key_fingerprint &other) const {
+    return std::memcmp(digest.data(), other.digest.data(), digest.size()) == 0;
+  }
+  bool operator!=(const key_fingerprint &other) const {
+    return !(*this == other);
+  }
+  bool operator<(const key_fingerprint &other) const {
+    return std::memcmp(digest.data(), other.digest.data(), digest.size()) < 0;
+  }
+};
+
+template <class T> key_fingerprint fingerprint(const T &key) {
+  CryptoPP::ByteQueue bq;
+  key.Save(bq);
+  CryptoPP::SHA256 sha;
+  CryptoPP::byte buf[256];
+  while (size_t len = bq.Get(buf, sizeof(buf))) {
+    sha.Update(buf, len);
+  }
+  key_fingerprint res;
+  sha.Final(res.digest.data());
+  return res;
+}
+
+// public key with its fingerprint computed once, as kept in contact tables
+struct fingerprinted_key {
+  CryptoPP::RSA::PublicKey key;
+  key_fingerprint id;
+
+  fingerprinted_key() = default;
+  explicit fingerprinted_key(CryptoPP::RSA::PublicKey k)
+      : key(std::move(k)), id(fingerprint(key)) {}
+};
+
 template <class T> bool compare_keys(const T &key1, const T &key2) {
-  std::string s1 = ::key_exchange::key_to_hex(key1);
-  std::string s2 = ::key_exchange::key_to_hex(key2);
-  return s1 == s2;
+  return fingerprint(key1) == fingerprint(key2);
+}
+
+template <class T>
+bool compare_keys(const key_fingerprint &known, const T &key) {
+  return known == fingerprint(key);
 }
 
 } // namespace digital_signature
 
+namespace std {
+// the digest is already uniform, its first word is the hash
+template <> struct hash<digital_signature::key_fingerprint> {
+  size_t operator()(const digital_signature::key_fingerprint &f) const {
+    size_t res;
+    std::memcpy(&res, f.digest.data(), sizeof(res));
+    return res;
+  }
+};
+} // namespace std
+
 namespace key_exchange {
 
 void save_private_key(CryptoPP::RSA::PrivateKey &private_key,
@@ -151,6 +206,11 @@ static CryptoPP::AutoSeededRandomPool prng;
 
 std::pair<CryptoPP::RSA::PublicKey, CryptoPP::RSA::PrivateKey> generate_key();
 
+// same with a caller owned generator, for threads other than the caller of
+// the one above
+std::pair<CryptoPP::RSA::PublicKey, CryptoPP::RSA::PrivateKey>
+generate_key(CryptoPP::RandomNumberGenerator &rng);
+
 CryptoPP::Integer rsa_encrypt(unsigned char *data, uint64_t data_size,
                               CryptoPP::RSA::PublicKey public_key);
 
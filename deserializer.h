@@ -4,7 +4,10 @@
 #include "chat.h"
 #include "crypto_utils.h"
 #include "network_types.h"
+#include <algorithm>
+#include <cstring>
 #include <memory>
+#include <string_view>
 #include <variant>
 namespace messenger {
 
@@ -22,6 +25,41 @@ public:
     }
   }
 
+  bool read_varint(uint64_t &value) {
+    value = 0;
+    for (uint32_t shift = 0; shift < 64; shift += 7) {
+      if (pointer >= limit) {
+        return false;
+      }
+      auto byte = static_cast<unsigned char>(data[pointer++]);
+      value |= uint64_t(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool read_string(std::string &str) {
+    uint64_t len = 0;
+    if (!read_varint(len) || len > limit - pointer) {
+      return false;
+    }
+    str.assign(&data[pointer], len);
+    pointer += len;
+    return true;
+  }
+
+  // fixed IDLEN field of the legacy format, cut at the first '\0'
+  bool read_id(std::string &str) {
+    if (pointer + IDLEN > limit) {
+      return false;
+    }
+    str.assign(&data[pointer], strnlen(&data[pointer], IDLEN - 1));
+    pointer += IDLEN;
+    return true;
+  }
+
   const char *get_pointer() { return &data[pointer]; }
   const char *get_limit() { return &data[limit]; }
 
@@ -44,6 +82,42 @@ public:
     }
   }
 
+  static uint64_t varint_size(uint64_t value) {
+    uint64_t size = 1;
+    while (value >= 0x80) {
+      value >>= 7;
+      size++;
+    }
+    return size;
+  }
+
+  static uint64_t string_size(std::string_view str) {
+    return varint_size(str.size()) + str.size();
+  }
+
+  bool write_varint(uint64_t value) {
+    char buf[10];
+    uint64_t size = 0;
+    while (value >= 0x80) {
+      buf[size++] = static_cast<char>((value & 0x7f) | 0x80);
+      value >>= 7;
+    }
+    buf[size++] = static_cast<char>(value);
+    return writer_sequentially(buf, size);
+  }
+
+  bool write_string(std::string_view str) {
+    write_varint(str.size());
+    return writer_sequentially(str.data(), str.size());
+  }
+
+  // fixed IDLEN field of the legacy format, zero padded
+  bool write_id(const std::string &str) {
+    char buf[IDLEN] = "";
+    std::memcpy(buf, str.data(), std::min<uint64_t>(str.size(), IDLEN - 1));
+    return writer_sequentially(buf, IDLEN);
+  }
+
   uint64_t get_pointer() { return pointer; }
   uint64_t get_limit() { return limit; }
 
@@ -55,20 +129,30 @@ private:
 
 class deserializer {
 public:
-  static std::variant<messenger::network_packets::paxos_notif_packet,
-                      messenger::network_packets::paxos_push_packet,
-                      network_packets::dialog_text,
-                      messenger::network_packets::request_chat_hash>
-  deserialize(std::shared_ptr<char[]> data, uint64_t len) {
-    auto raw_data = data.get();
-
-    reader data_reader(raw_data, len);
+  using packet = std::variant<messenger::network_packets::paxos_notif_packet,
+                              messenger::network_packets::paxos_push_packet,
+                              network_packets::dialog_text,
+                              messenger::network_packets::request_chat_hash,
+                              messenger::network_packets::chat_history_chunk,
+                              messenger::network_packets::merkle_node,
+                              messenger::network_packets::paxos_commit_packet>;
+
+  // network_type of a packet in either wire format, -1 if empty
+  static int packet_type(const char *data, uint64_t len) {
+    if (len > 1 && data[0] == protocol_compact) {
+      return static_cast<unsigned char>(data[1]);
+    }
+    return len > 0 ? static_cast<unsigned char>(data[0]) : -1;
+  }
+
+  static packet deserialize(std::shared_ptr<char[]> data, uint64_t len) {
+    reader data_reader(data.get(), len);
     char type = 0;
     if (!data_reader.read_sequentially(&type, 1)) {
-      return std::variant<messenger::network_packets::paxos_notif_packet,
-                          messenger::network_packets::paxos_push_packet,
-                          network_packets::dialog_text,
-                          messenger::network_packets::request_chat_hash>();
+      return packet();
+    }
+    if (type == protocol_compact) {
+      return deserialize_compact(data_reader);
     }
     if (type == network_type::dialog_text) { // id+text
       network_packets::dialog_text pack;
@@ -86,193 +170,316 @@ public:
       }
     } else if (type == network_type::paxos_notif) {
       network_packets::paxos_notif_packet pack;
-      data_reader.read_sequentially(pack.chat_id, sizeof(pack.chat_id));
-      data_reader.read_sequentially(pack.id, sizeof(pack.id));
-      pack.chat_id[IDLEN - 1] = '\0';
-      pack.id[IDLEN - 1] = '\0';
-      bool total_result =
-          data_reader.read_sequentially(pack.hash, sizeof(pack.hash));
-      if (total_result) {
+      data_reader.read_id(pack.chat_id);
+      data_reader.read_id(pack.id);
+      if (data_reader.read_id(pack.hash)) {
+        pack.seq = network_packets::paxos_notif_packet::legacy_seq;
         return pack;
       }
     } else if (type ==
                network_type::paxos_push) { // first byte - chat_event_type
       messenger::network_packets::paxos_push_packet pack;
-      char event_type;
+      std::shared_ptr<messenger::chat_event> c_event_ptr;
+      char event_type = 0;
       data_reader.read_sequentially(&event_type, 1);
-      data_reader.read_sequentially(pack.chat_id, sizeof(pack.chat_id));
-      data_reader.read_sequentially(pack.id, sizeof(pack.id));
+      data_reader.read_id(pack.chat_id);
+      data_reader.read_id(pack.id);
       bool res = data_reader.read_sequentially(
           reinterpret_cast<char *>(&pack.time), sizeof(pack.time));
       if (res) {
         if (event_type == messenger::chat_event_types::chat_text_type) {
           std::shared_ptr<messenger::chat_text> c_event(
               new messenger::chat_text);
-          uint64_t string_len =
-              data_reader.get_limit() - data_reader.get_pointer();
-          std::unique_ptr<char> str(new char[string_len]);
-          if (data_reader.read_sequentially(str.get(), string_len)) {
-            c_event->event_type = event_type;
-            c_event->text = std::string(str.get(), string_len);
-            c_event->time = pack.time;
-            c_event->initiator = std::string(pack.id);
-            pack.c_event = std::move(c_event);
-            return pack;
-          }
+          c_event->text.assign(data_reader.get_pointer(),
+                               data_reader.get_limit());
+          c_event_ptr = std::move(c_event);
         }
         if (event_type == messenger::chat_event_types::chat_new_user_type) {
           std::shared_ptr<messenger::chat_new_user> c_event(
               new messenger::chat_new_user);
-          std::unique_ptr<char> user_id(new char[IDLEN]);
-          if (data_reader.read_sequentially(user_id.get(), IDLEN)) {
-            c_event->event_type = event_type;
-            c_event->time = pack.time;
-            c_event->new_user_id = std::string(user_id.get(), IDLEN);
-            c_event->initiator = std::string(pack.id, IDLEN);
-            pack.c_event = std::move(c_event);
-            return pack;
+          if (data_reader.read_id(c_event->new_user_id)) {
+            c_event_ptr = std::move(c_event);
           }
         }
         if (event_type == messenger::chat_event_types::transfer_type) {
           std::shared_ptr<messenger::transfer> c_event(new messenger::transfer);
-          uint32_t amount = 0;
-          std::unique_ptr<char[]> recipient(new char[IDLEN]);
-          data_reader.read_sequentially(reinterpret_cast<char *>(&amount),
-                                        sizeof(c_event->amount));
-          if (data_reader.read_sequentially(recipient.get(), IDLEN)) {
-            c_event->event_type = event_type;
-            c_event->time = pack.time;
-            c_event->amount = amount;
-            c_event->initiator = std::string(pack.id, IDLEN);
-            c_event->recipient = std::string(recipient.get(), IDLEN);
-            pack.c_event = std::move(c_event);
-            return pack;
+          data_reader.read_sequentially(
+              reinterpret_cast<char *>(&c_event->amount),
+              sizeof(c_event->amount));
+          if (data_reader.read_id(c_event->recipient)) {
+            c_event_ptr = std::move(c_event);
           }
         }
+        if (c_event_ptr != nullptr) {
+          c_event_ptr->event_type = event_type;
+          c_event_ptr->time = pack.time;
+          c_event_ptr->initiator = pack.id;
+          pack.events.push_back(std::move(c_event_ptr));
+          return pack;
+        }
       }
     } else if (type == messenger::network_type::chat_sync) {
       messenger::network_packets::request_chat_hash pack;
-      data_reader.read_sequentially(pack.chat_id, sizeof(pack.chat_id));
-      data_reader.read_sequentially(pack.id, sizeof(pack.id));
+      data_reader.read_id(pack.chat_id);
+      data_reader.read_id(pack.id);
       if (data_reader.read_sequentially((char *)(&pack.time),
                                         sizeof(pack.time))) {
         return pack;
       }
     }
 
-    return std::variant<messenger::network_packets::paxos_notif_packet,
-                        messenger::network_packets::paxos_push_packet,
-                        network_packets::dialog_text,
-                        messenger::network_packets::request_chat_hash>();
+    return packet();
   }
 
+  // packet with its uint64_t length prefix in a single allocation
+  template <typename packet_t>
   static std::pair<std::shared_ptr<char[]>, uint64_t>
-  serialize(const messenger::network_packets::paxos_notif_packet &pack) {
-    uint64_t len =
-        1 + sizeof(messenger::network_packets::paxos_notif_packet::chat_id) +
-        sizeof(messenger::network_packets::paxos_notif_packet::id) +
-        sizeof(messenger::network_packets::paxos_notif_packet::hash);
-    std::shared_ptr<char[]> data(new char[len]);
-    data[0] = network_type::paxos_notif;
-    std::memcpy(&data[1], pack.chat_id, sizeof(pack.chat_id));
-    std::memcpy(&data[1 + sizeof(pack.chat_id)], pack.id, sizeof(pack.id));
-    std::memcpy(&data[1 + sizeof(pack.chat_id) + sizeof(pack.id)], pack.hash,
-                sizeof(pack.hash));
-    return {data, len};
+  serialize_frame(const packet_t &pack,
+                  wire_format format = wire_format::compact) {
+    uint64_t len = serialized_size(pack, format);
+    if (len == 0) {
+      return {nullptr, 0};
+    }
+    std::shared_ptr<char[]> data(new char[sizeof(len) + len]);
+    writer data_writer(data.get(), sizeof(len) + len);
+    data_writer.writer_sequentially((char *)(&len), sizeof(len));
+    if (serialize_into(data_writer, pack, format)) {
+      return {data, sizeof(len) + len};
+    }
+    return {nullptr, 0};
   }
 
+  template <typename packet_t>
   static std::pair<std::shared_ptr<char[]>, uint64_t>
-  serialize(const messenger::network_packets::paxos_push_packet &obj) {
-    uint64_t len = 0;
-    std::shared_ptr<char[]> data;
-
-    if (obj.c_event->event_type == chat_event_types::chat_text_type) {
-      std::shared_ptr<messenger::chat_text> c_event =
-          std::dynamic_pointer_cast<messenger::chat_text>(obj.c_event);
-      len = static_cast<uint64_t>(1) + 1 + sizeof(obj.chat_id) +
-            sizeof(obj.id) + sizeof(obj.time) +
-            c_event->text.size(); // network type+event type+event data
-    }
-    if (obj.c_event->event_type == chat_event_types::chat_new_user_type) {
-      std::shared_ptr<messenger::chat_new_user> c_event =
-          std::dynamic_pointer_cast<messenger::chat_new_user>(obj.c_event);
-      len = static_cast<uint64_t>(1) + 1 + sizeof(obj.chat_id) +
-            sizeof(obj.id) + sizeof(obj.time) + c_event->new_user_id.size(); //
-    }
-
-    if (obj.c_event->event_type == chat_event_types::transfer_type) {
-      std::shared_ptr<messenger::transfer> c_event =
-          std::dynamic_pointer_cast<messenger::transfer>(obj.c_event);
-      len = static_cast<uint64_t>(1) + 1 + sizeof(obj.chat_id) +
-            sizeof(obj.id) + sizeof(obj.time) + sizeof(c_event->amount) +
-            c_event->recipient.size(); //...+512
-    }
-
-    data = std::shared_ptr<char[]>(new char[len]);
-    auto raw_data = data.get();
-    writer data_writer(raw_data, len);
-    char network_type = network_type::paxos_push;
-    data_writer.writer_sequentially(&network_type, 1);
-    data_writer.writer_sequentially(&obj.c_event->event_type, 1);
-    data_writer.writer_sequentially(
-        obj.chat_id,
-        sizeof(messenger::network_packets::paxos_push_packet::chat_id));
-    data_writer.writer_sequentially(
-        obj.id, sizeof(messenger::network_packets::paxos_push_packet::id));
-    data_writer.writer_sequentially(
-        reinterpret_cast<const char *>(&obj.time),
-        sizeof(messenger::network_packets::paxos_push_packet::time));
-    if (obj.c_event->event_type == chat_event_types::chat_text_type) {
-      std::shared_ptr<messenger::chat_text> c_event =
-          std::dynamic_pointer_cast<messenger::chat_text>(obj.c_event);
-      bool res = data_writer.writer_sequentially(c_event->text.c_str(),
-                                                 c_event->text.size());
-      if (res) {
-        return {data, len};
+  serialize(const packet_t &pack,
+            wire_format format = wire_format::compact) {
+    uint64_t len = serialized_size(pack, format);
+    if (len == 0) {
+      return {nullptr, 0};
+    }
+    std::shared_ptr<char[]> data(new char[len]);
+    writer data_writer(data.get(), len);
+    if (serialize_into(data_writer, pack, format)) {
+      return {data, len};
+    }
+    return {nullptr, 0};
+  }
+
+  static uint64_t
+  serialized_size(const messenger::network_packets::paxos_notif_packet &pack,
+                  wire_format format) {
+    if (format == wire_format::legacy) { // without seq
+      return 1 + 3 * IDLEN;
+    }
+    return 2 + writer::string_size(pack.chat_id) +
+           writer::string_size(pack.id) + writer::string_size(pack.hash) +
+           writer::varint_size(pack.seq);
+  }
+
+  static bool
+  serialize_into(writer &data_writer,
+                 const messenger::network_packets::paxos_notif_packet &pack,
+                 wire_format format) {
+    write_header(data_writer, network_type::paxos_notif, format);
+    if (format == wire_format::legacy) {
+      data_writer.write_id(pack.chat_id);
+      data_writer.write_id(pack.id);
+      return data_writer.write_id(pack.hash);
+    }
+    data_writer.write_string(pack.chat_id);
+    data_writer.write_string(pack.id);
+    data_writer.write_string(pack.hash);
+    return data_writer.write_varint(pack.seq);
+  }
+
+  // the legacy format carries exactly one event
+  static uint64_t
+  serialized_size(const messenger::network_packets::paxos_push_packet &obj,
+                  wire_format format) {
+    if (obj.events.empty()) {
+      return 0;
+    }
+    if (format == wire_format::legacy) {
+      if (obj.events.size() != 1) {
+        return 0;
+      }
+      auto &c_event_ptr = obj.events.front();
+      // network type+event type+event data
+      uint64_t len =
+          static_cast<uint64_t>(1) + 1 + 2 * IDLEN + sizeof(obj.time);
+      if (c_event_ptr->event_type == chat_event_types::chat_text_type) {
+        auto c_event = static_cast<messenger::chat_text *>(c_event_ptr.get());
+        return len + c_event->text.size();
+      }
+      if (c_event_ptr->event_type == chat_event_types::chat_new_user_type) {
+        return len + IDLEN;
+      }
+      if (c_event_ptr->event_type == chat_event_types::transfer_type) {
+        return len + sizeof(messenger::transfer::amount) + IDLEN;
       }
+      return 0;
     }
-    if (obj.c_event->event_type == chat_event_types::chat_new_user_type) {
-      std::shared_ptr<messenger::chat_new_user> c_event =
-          std::dynamic_pointer_cast<messenger::chat_new_user>(obj.c_event);
-      bool res = data_writer.writer_sequentially(c_event->new_user_id.c_str(),
-                                                 c_event->new_user_id.size());
-      if (res) {
-        return {data, len};
+    uint64_t len = 2 + writer::string_size(obj.chat_id) +
+                   writer::string_size(obj.id) + writer::varint_size(obj.time) +
+                   writer::varint_size(obj.events.size());
+    for (auto &i : obj.events) {
+      if (event_body_size(*i) == 0) {
+        return 0;
       }
+      len += event_size(*i);
     }
+    return len;
+  }
 
-    if (obj.c_event->event_type == chat_event_types::transfer_type) {
-      std::shared_ptr<messenger::transfer> c_event =
-          std::dynamic_pointer_cast<messenger::transfer>(obj.c_event);
+  static bool
+  serialize_into(writer &data_writer,
+                 const messenger::network_packets::paxos_push_packet &obj,
+                 wire_format format) {
+    write_header(data_writer, network_type::paxos_push, format);
+    if (format == wire_format::compact) {
+      data_writer.write_string(obj.chat_id);
+      data_writer.write_string(obj.id);
+      data_writer.write_varint(obj.time);
+      bool res = data_writer.write_varint(obj.events.size());
+      for (auto &i : obj.events) {
+        res = write_event(data_writer, *i);
+      }
+      return res;
+    }
+    auto &c_event_ptr = obj.events.front();
+    data_writer.writer_sequentially(&c_event_ptr->event_type, 1);
+    data_writer.write_id(obj.chat_id);
+    data_writer.write_id(obj.id);
+    data_writer.writer_sequentially(reinterpret_cast<const char *>(&obj.time),
+                                    sizeof(obj.time));
+    if (c_event_ptr->event_type == chat_event_types::chat_text_type) {
+      auto c_event = static_cast<messenger::chat_text *>(c_event_ptr.get());
+      return data_writer.writer_sequentially(c_event->text.c_str(),
+                                             c_event->text.size());
+    }
+    if (c_event_ptr->event_type == chat_event_types::chat_new_user_type) {
+      auto c_event = static_cast<messenger::chat_new_user *>(c_event_ptr.get());
+      return data_writer.write_id(c_event->new_user_id);
+    }
+    if (c_event_ptr->event_type == chat_event_types::transfer_type) {
+      auto c_event = static_cast<messenger::transfer *>(c_event_ptr.get());
       data_writer.writer_sequentially(
           reinterpret_cast<char *>(&c_event->amount), sizeof(c_event->amount));
-      bool res = data_writer.writer_sequentially(c_event->recipient.c_str(),
-                                                 c_event->recipient.size());
-      if (res) {
-        return {data, len};
-      }
+      return data_writer.write_id(c_event->recipient);
     }
-
-    return {std::shared_ptr<char[]>(nullptr), 0};
+    return false;
   }
 
+  // compact frame with the event views [begin, end) of a chat history
+  template <typename iterator>
   static std::pair<std::shared_ptr<char[]>, uint64_t>
-  serialize(const messenger::network_packets::request_chat_hash &pack) {
-    uint64_t len =
-        1 + sizeof(pack.chat_id) + sizeof(pack.id) + sizeof(pack.time);
-    std::shared_ptr<char[]> data(new char[len]);
-    writer data_writer(data.get(), len);
-    char type = messenger::network_type::chat_sync;
-    data_writer.writer_sequentially(&type, 1);
-    data_writer.writer_sequentially(pack.chat_id, sizeof(pack.chat_id));
-    data_writer.writer_sequentially(pack.id, sizeof(pack.id));
-    bool res = data_writer.writer_sequentially((char *)(&pack.time),
-                                               sizeof(pack.time));
+  serialize_history_chunk(const std::string &chat_id, uint64_t first_index,
+                          bool last, iterator begin, iterator end) {
+    uint64_t len = 2 + writer::string_size(chat_id) +
+                   writer::varint_size(first_index) + 1 +
+                   writer::varint_size(end - begin);
+    for (auto it = begin; it != end; ++it) {
+      len += event_size(*it);
+    }
+    std::shared_ptr<char[]> data(new char[sizeof(len) + len]);
+    writer data_writer(data.get(), sizeof(len) + len);
+    data_writer.writer_sequentially((char *)(&len), sizeof(len));
+    write_header(data_writer, network_type::chat_history_chunk,
+                 wire_format::compact);
+    data_writer.write_string(chat_id);
+    data_writer.write_varint(first_index);
+    char last_flag = last ? 1 : 0;
+    data_writer.writer_sequentially(&last_flag, 1);
+    bool res = data_writer.write_varint(end - begin);
+    for (auto it = begin; it != end; ++it) {
+      res = write_event(data_writer, *it);
+    }
     if (res) {
-      return {data, len};
-    } else {
-      return {nullptr, 0};
+      return {data, sizeof(len) + len};
+    }
+    return {nullptr, 0};
+  }
+
+  // event_type, initiator, time and body of a stored chat event
+  static uint64_t event_size(const messenger::chat_event_view &c_event) {
+    return 1 + writer::string_size(c_event.initiator) +
+           writer::varint_size(c_event.time) + event_body_size(c_event);
+  }
+
+  static uint64_t
+  serialized_size(const messenger::network_packets::request_chat_hash &pack,
+                  wire_format format) {
+    if (format == wire_format::legacy) {
+      return 1 + 2 * IDLEN + sizeof(pack.time);
     }
+    return 2 + writer::string_size(pack.chat_id) +
+           writer::string_size(pack.id) + writer::varint_size(pack.time) +
+           writer::varint_size(pack.history_len) +
+           writer::string_size(pack.history_hash);
+  }
+
+  static bool
+  serialize_into(writer &data_writer,
+                 const messenger::network_packets::request_chat_hash &pack,
+                 wire_format format) {
+    write_header(data_writer, network_type::chat_sync, format);
+    if (format == wire_format::legacy) {
+      data_writer.write_id(pack.chat_id);
+      data_writer.write_id(pack.id);
+      return data_writer.writer_sequentially((char *)(&pack.time),
+                                             sizeof(pack.time));
+    }
+    data_writer.write_string(pack.chat_id);
+    data_writer.write_string(pack.id);
+    data_writer.write_varint(pack.time);
+    data_writer.write_varint(pack.history_len);
+    return data_writer.write_string(pack.history_hash);
+  }
+
+  static uint64_t
+  serialized_size(const messenger::network_packets::merkle_node &pack,
+                  wire_format format) {
+    if (format == wire_format::legacy) {
+      return 0;
+    }
+    return 2 + writer::string_size(pack.chat_id) +
+           writer::varint_size(pack.level) + writer::varint_size(pack.index) +
+           writer::varint_size(pack.leaf_count) +
+           writer::string_size(pack.digest);
+  }
+
+  static bool
+  serialize_into(writer &data_writer,
+                 const messenger::network_packets::merkle_node &pack,
+                 wire_format format) {
+    write_header(data_writer, network_type::merkle_node, format);
+    data_writer.write_string(pack.chat_id);
+    data_writer.write_varint(pack.level);
+    data_writer.write_varint(pack.index);
+    data_writer.write_varint(pack.leaf_count);
+    return data_writer.write_string(pack.digest);
+  }
+
+  static uint64_t
+  serialized_size(const messenger::network_packets::paxos_commit_packet &pack,
+                  wire_format format) {
+    if (format == wire_format::legacy) {
+      return 0;
+    }
+    return 2 + writer::string_size(pack.chat_id) +
+           writer::string_size(pack.id) + writer::varint_size(pack.seq) +
+           writer::string_size(pack.hash);
+  }
+
+  static bool
+  serialize_into(writer &data_writer,
+                 const messenger::network_packets::paxos_commit_packet &pack,
+                 wire_format format) {
+    write_header(data_writer, network_type::paxos_commit, format);
+    data_writer.write_string(pack.chat_id);
+    data_writer.write_string(pack.id);
+    data_writer.write_varint(pack.seq);
+    return data_writer.write_string(pack.hash);
   }
 
   static std::pair<std::shared_ptr<char[]>, uint64_t>
@@ -298,6 +505,186 @@ public:
       return {nullptr, 0};
     }
   }
+
+private:
+  static void write_header(writer &data_writer, char type, wire_format format) {
+    if (format == wire_format::compact) {
+      char version = protocol_compact;
+      data_writer.writer_sequentially(&version, 1);
+    }
+    data_writer.writer_sequentially(&type, 1);
+  }
+
+  static uint64_t event_body_size(const messenger::chat_event_view &c_event) {
+    if (c_event.event_type == chat_event_types::chat_text_type ||
+        c_event.event_type == chat_event_types::chat_new_user_type) {
+      return writer::string_size(c_event.body);
+    }
+    if (c_event.event_type == chat_event_types::transfer_type) {
+      return writer::varint_size(c_event.amount) +
+             writer::string_size(c_event.body);
+    }
+    return 0;
+  }
+
+  static bool write_event_body(writer &data_writer,
+                               const messenger::chat_event_view &c_event) {
+    if (c_event.event_type == chat_event_types::chat_text_type ||
+        c_event.event_type == chat_event_types::chat_new_user_type) {
+      return data_writer.write_string(c_event.body);
+    }
+    if (c_event.event_type == chat_event_types::transfer_type) {
+      data_writer.write_varint(c_event.amount);
+      return data_writer.write_string(c_event.body);
+    }
+    return false;
+  }
+
+  static std::shared_ptr<messenger::chat_event>
+  read_event_body(reader &data_reader, char event_type) {
+    std::shared_ptr<messenger::chat_event> res;
+    if (event_type == chat_event_types::chat_text_type) {
+      std::shared_ptr<messenger::chat_text> c_event(new messenger::chat_text);
+      if (data_reader.read_string(c_event->text)) {
+        res = std::move(c_event);
+      }
+    } else if (event_type == chat_event_types::chat_new_user_type) {
+      std::shared_ptr<messenger::chat_new_user> c_event(
+          new messenger::chat_new_user);
+      if (data_reader.read_string(c_event->new_user_id)) {
+        res = std::move(c_event);
+      }
+    } else if (event_type == chat_event_types::transfer_type) {
+      std::shared_ptr<messenger::transfer> c_event(new messenger::transfer);
+      uint64_t amount = 0;
+      if (data_reader.read_varint(amount) &&
+          data_reader.read_string(c_event->recipient)) {
+        c_event->amount = static_cast<uint32_t>(amount);
+        res = std::move(c_event);
+      }
+    }
+    if (res != nullptr) {
+      res->event_type = event_type;
+    }
+    return res;
+  }
+
+  static bool write_event(writer &data_writer,
+                          const messenger::chat_event_view &c_event) {
+    data_writer.writer_sequentially(&c_event.event_type, 1);
+    data_writer.write_string(c_event.initiator);
+    data_writer.write_varint(c_event.time);
+    return write_event_body(data_writer, c_event);
+  }
+
+  // event_type byte, initiator length, time and an empty body
+  static constexpr uint64_t min_event_size = 4;
+
+  static std::shared_ptr<messenger::chat_event> read_event(reader &data_reader) {
+    char event_type = 0;
+    std::string initiator;
+    uint64_t time = 0;
+    if (!data_reader.read_sequentially(&event_type, 1) ||
+        !data_reader.read_string(initiator) || !data_reader.read_varint(time)) {
+      return nullptr;
+    }
+    auto c_event = read_event_body(data_reader, event_type);
+    if (c_event != nullptr) {
+      c_event->initiator = std::move(initiator);
+      c_event->time = time;
+    }
+    return c_event;
+  }
+
+  // everything after the protocol_compact byte
+  static packet deserialize_compact(reader &data_reader) {
+    char type = 0;
+    data_reader.read_sequentially(&type, 1);
+    if (type == network_type::paxos_notif) {
+      network_packets::paxos_notif_packet pack;
+      if (data_reader.read_string(pack.chat_id) &&
+          data_reader.read_string(pack.id) &&
+          data_reader.read_string(pack.hash) &&
+          data_reader.read_varint(pack.seq)) {
+        return pack;
+      }
+    } else if (type == network_type::paxos_push) {
+      network_packets::paxos_push_packet pack;
+      uint64_t count = 0;
+      if (!data_reader.read_string(pack.chat_id) ||
+          !data_reader.read_string(pack.id) ||
+          !data_reader.read_varint(pack.time) ||
+          !data_reader.read_varint(count) || count == 0 ||
+          count > uint64_t(data_reader.get_limit() -
+                           data_reader.get_pointer()) /
+                      min_event_size) {
+        return packet();
+      }
+      pack.events.reserve(count);
+      for (uint64_t i = 0; i < count; i++) {
+        auto c_event = read_event(data_reader);
+        if (c_event == nullptr) {
+          return packet();
+        }
+        pack.events.push_back(std::move(c_event));
+      }
+      return pack;
+    } else if (type == network_type::chat_history_chunk) {
+      network_packets::chat_history_chunk pack;
+      char last_flag = 0;
+      uint64_t count = 0;
+      data_reader.read_string(pack.chat_id);
+      data_reader.read_varint(pack.first_index);
+      data_reader.read_sequentially(&last_flag, 1);
+      // count is bounded by the bytes left, so reserve stays proportional
+      // to the frame
+      if (!data_reader.read_varint(count) ||
+          count > uint64_t(data_reader.get_limit() -
+                           data_reader.get_pointer()) /
+                      min_event_size) {
+        return packet();
+      }
+      pack.last = last_flag != 0;
+      pack.events.reserve(count);
+      for (uint64_t i = 0; i < count; i++) {
+        auto c_event = read_event(data_reader);
+        if (c_event == nullptr) {
+          return packet();
+        }
+        pack.events.push_back(std::move(c_event));
+      }
+      return pack;
+    } else if (type == network_type::chat_sync) {
+      network_packets::request_chat_hash pack;
+      if (data_reader.read_string(pack.chat_id) &&
+          data_reader.read_string(pack.id) &&
+          data_reader.read_varint(pack.time) &&
+          data_reader.read_varint(pack.history_len) &&
+          data_reader.read_string(pack.history_hash)) {
+        return pack;
+      }
+    } else if (type == network_type::merkle_node) {
+      network_packets::merkle_node pack;
+      uint64_t level = 0;
+      if (data_reader.read_string(pack.chat_id) &&
+          data_reader.read_varint(level) && level < 64 &&
+          data_reader.read_varint(pack.index) &&
+          data_reader.read_varint(pack.leaf_count) &&
+          data_reader.read_string(pack.digest)) {
+        pack.level = level;
+        return pack;
+      }
+    } else if (type == network_type::paxos_commit) {
+      network_packets::paxos_commit_packet pack;
+      if (data_reader.read_string(pack.chat_id) &&
+          data_reader.read_string(pack.id) &&
+          data_reader.read_varint(pack.seq) &&
+          data_reader.read_string(pack.hash)) {
+        return pack;
+      }
+    }
+    return packet();
+  }
 };
 
 } // namespace messenger
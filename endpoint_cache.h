@@ -0,0 +1,118 @@
+#ifndef ENDPOINT_CACHE_H
+#define ENDPOINT_CACHE_H
+
+#include "boost/asio.hpp"
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace messenger {
+namespace network {
+
+// Resolved contact addresses. "host:port" is split once when the contact is
+// added, numeric addresses never hit the resolver and hostnames are
+// re-resolved after ttl.
+class endpoint_cache {
+public:
+  using endpoints_type = std::vector<boost::asio::ip::tcp::endpoint>;
+
+  endpoint_cache(std::chrono::seconds t = std::chrono::minutes(5)) : ttl(t) {}
+
+  bool add(const std::string &id, const std::string &address) {
+    auto pos = address.rfind(':');
+    if (pos == std::string::npos) {
+      return false;
+    }
+    auto e = std::make_shared<entry>();
+    e->host = address.substr(0, pos);
+    e->port = address.substr(pos + 1);
+    boost::system::error_code ec;
+    auto ip = boost::asio::ip::make_address(e->host, ec);
+    unsigned long port = 0;
+    try {
+      port = std::stoul(e->port);
+    } catch (const std::exception &) {
+      port = 0;
+    }
+    if (!ec && port != 0 && port <= 65535) {
+      e->numeric = true;
+      e->endpoints = std::make_shared<const endpoints_type>(
+          1, boost::asio::ip::tcp::endpoint(ip, (unsigned short)port));
+    }
+    std::unique_lock ul{locker};
+    entries[id] = std::move(e);
+    return true;
+  }
+
+  bool contains(const std::string &id) {
+    std::unique_lock ul{locker};
+    return entries.find(id) != entries.end();
+  }
+
+  // functor(error_code, std::shared_ptr<const endpoints_type>). A miss
+  // resolves with its own resolver on io, resolvers are not thread safe and
+  // callers run on different threads.
+  template <typename functor>
+  void async_resolve(boost::asio::io_context &io, const std::string &id,
+                     functor handler) {
+    std::shared_ptr<entry> e;
+    {
+      std::unique_lock ul{locker};
+      auto it = entries.find(id);
+      if (it != entries.end()) {
+        e = it->second;
+        if (e->endpoints != nullptr &&
+            (e->numeric || std::chrono::steady_clock::now() < e->expires)) {
+          auto res = e->endpoints;
+          ul.unlock();
+          handler(boost::system::error_code(), std::move(res));
+          return;
+        }
+      }
+    }
+    if (e == nullptr) {
+      handler(boost::asio::error::host_not_found, nullptr);
+      return;
+    }
+    auto resolver = std::make_shared<boost::asio::ip::tcp::resolver>(io);
+    resolver->async_resolve(
+        e->host, e->port,
+        [this, e, resolver,
+         handler](const boost::system::error_code &ec,
+                  boost::asio::ip::tcp::resolver::results_type res) {
+          if (ec) {
+            handler(ec, nullptr);
+            return;
+          }
+          auto resolved =
+              std::make_shared<const endpoints_type>(res.begin(), res.end());
+          {
+            std::unique_lock ul{locker};
+            e->endpoints = resolved;
+            e->expires = std::chrono::steady_clock::now() + ttl;
+          }
+          handler(ec, std::move(resolved));
+        });
+  }
+
+private:
+  struct entry {
+    std::string host;
+    std::string port;
+    bool numeric = false;
+    std::shared_ptr<const endpoints_type> endpoints;
+    std::chrono::steady_clock::time_point expires;
+  };
+
+  std::chrono::seconds ttl;
+  std::map<std::string, std::shared_ptr<entry>> entries;
+  std::mutex locker;
+};
+
+} // namespace network
+} // namespace messenger
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace messenger {
+namespace network {
+
+// Slab pool of power-of-two size classes for received frames, their length
+// prefixes and the read handlers. Freed blocks are kept on per-class free
+// lists up to a byte budget, so a steady stream of frames is served without
+// touching the heap. Blocks may be freed from any thread.
+class frame_pool {
+public:
+  static constexpr unsigned min_shift = 6;  // 64 bytes
+  static constexpr unsigned max_shift = 20; // larger frames use the heap
+  static constexpr size_t class_budget = 4 << 20;
+  static constexpr size_t max_cached = 256;
+
+  frame_pool() {
+    for (unsigned i = 0; i < classes.size(); i++) {
+      classes[i].cap = std::min(max_cached, class_budget >> (min_shift + i));
+      classes[i].free.reserve(classes[i].cap);
+    }
+  }
+
+  frame_pool(const frame_pool &) = delete;
+  frame_pool &operator=(const frame_pool &) = delete;
+
+  ~frame_pool() {
+    for (auto &c : classes) {
+      for (void *p : c.free) {
+        ::operator delete(p);
+      }
+    }
+  }
+
+  void *allocate(size_t bytes) {
+    auto i = class_of(bytes);
+    if (i >= classes.size()) {
+      return ::operator new(bytes);
+    }
+    {
+      std::unique_lock ul{classes[i].locker};
+      if (!classes[i].free.empty()) {
+        void *p = classes[i].free.back();
+        classes[i].free.pop_back();
+        return p;
+      }
+    }
+    return ::operator new(size_t(1) << (min_shift + i));
+  }
+
+  void deallocate(void *p, size_t bytes) {
+    auto i = class_of(bytes);
+    if (i < classes.size()) {
+      std::unique_lock ul{classes[i].locker};
+      if (classes[i].free.size() < classes[i].cap) {
+        classes[i].free.push_back(p);
+        return;
+      }
+    }
+    ::operator delete(p);
+  }
+
+  // std allocator over the pool, also used as the handlers' associated
+  // allocator and for shared_ptr control blocks
+  template <typename T> class allocator {
+  public:
+    using value_type = T;
+
+    explicit allocator(frame_pool *p) noexcept : pool(p) {}
+    template <typename U>
+    allocator(const allocator<U> &other) noexcept : pool(other.pool) {}
+
+    T *allocate(size_t n) {
+      return static_cast<T *>(pool->allocate(n * sizeof(T)));
+    }
+    void deallocate(T *p, size_t n) { pool->deallocate(p, n * sizeof(T)); }
+
+    template <typename U> bool operator==(const allocator<U> &other) const {
+      return pool == other.pool;
+    }
+    template <typename U> bool operator!=(const allocator<U> &other) const {
+      return pool != other.pool;
+    }
+
+  private:
+    template <typename> friend class allocator;
+    frame_pool *pool;
+  };
+
+  allocator<void> get_allocator() noexcept { return allocator<void>(this); }
+
+  // uninitialized buffer of len bytes, returned to the pool with its last
+  // reference
+  std::shared_ptr<char[]> acquire(uint64_t len) {
+    char *p = static_cast<char *>(allocate(len));
+    return std::shared_ptr<char[]>(
+        p, [this, len](char *p) { deallocate(p, len); },
+        allocator<char>(this));
+  }
+
+private:
+  static size_t class_of(size_t bytes) {
+    unsigned shift = min_shift;
+    while (shift <= max_shift && (size_t(1) << shift) < bytes) {
+      shift++;
+    }
+    return shift - min_shift;
+  }
+
+  struct size_class {
+    std::mutex locker;
+    std::vector<void *> free;
+    size_t cap = 0;
+  };
+
+  std::array<size_class, max_shift - min_shift + 1> classes;
+};
+
+// binds a completion handler to the pool, so asio allocates its operation
+// state from it
+template <typename functor> class pooled_handler {
+public:
+  using allocator_type = frame_pool::allocator<void>;
+
+  pooled_handler(frame_pool &p, functor f)
+      : pool(&p), handler(std::move(f)) {}
+
+  allocator_type get_allocator() const noexcept {
+    return allocator_type(pool);
+  }
+
+  template <typename... args> void operator()(args &&...a) {
+    handler(std::forward<args>(a)...);
+  }
+
+private:
+  frame_pool *pool;
+  functor handler;
+};
+
+template <typename functor>
+pooled_handler<functor> bind_pool(frame_pool &pool, functor handler) {
+  return pooled_handler<functor>(pool, std::move(handler));
+}
+
+} // namespace network
+} // namespace messenger
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef ID_INTERNER_H
+#define ID_INTERNER_H
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace messenger {
+
+using id_handle = uint32_t;
+
+// Process-wide table of user, chat and key ids. Every distinct id gets a
+// dense handle the first time it is seen and keeps it for the life of the
+// process, so hot paths compare and index by handle instead of by string.
+class id_interner {
+public:
+  static constexpr size_t chunk_size = 4096;
+  static constexpr size_t max_chunks = 1024;
+
+  static id_interner &global() {
+    static id_interner table;
+    return table;
+  }
+
+  id_interner() = default;
+  id_interner(const id_interner &) = delete;
+  id_interner &operator=(const id_interner &) = delete;
+
+  ~id_interner() {
+    for (auto &i : chunks) {
+      delete[] i.load();
+    }
+  }
+
+  id_handle intern(std::string_view id) {
+    {
+      std::shared_lock sl{locker};
+      auto it = index.find(id);
+      if (it != index.end()) {
+        return it->second;
+      }
+    }
+    std::unique_lock ul{locker};
+    auto it = index.find(id);
+    if (it != index.end()) {
+      return it->second;
+    }
+    if (count == chunk_size * max_chunks) {
+      throw std::length_error("id_interner is full");
+    }
+    id_handle h = count;
+    if (h % chunk_size == 0) {
+      chunks[h / chunk_size].store(new std::string[chunk_size],
+                                   std::memory_order_release);
+    }
+    std::string &slot = chunks[h / chunk_size].load()[h % chunk_size];
+    slot = id;
+    index.emplace(slot, h);
+    count++;
+    return h;
+  }
+
+  // lookup without inserting, for ids taken from the network
+  std::optional<id_handle> find(std::string_view id) const {
+    std::shared_lock sl{locker};
+    auto it = index.find(id);
+    if (it == index.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  // lock free, names never move once interned
+  const std::string &name(id_handle h) const {
+    return chunks[h / chunk_size].load(std::memory_order_acquire)
+        [h % chunk_size];
+  }
+
+private:
+  std::array<std::atomic<std::string *>, max_chunks> chunks{};
+  id_handle count = 0;
+  std::unordered_map<std::string_view, id_handle> index;
+  mutable std::shared_mutex locker;
+};
+
+// Open addressing map keyed by handles, linear probing with backward shift
+// deletion. Meant for small per-chat and per-peer tables.
+template <typename value> class handle_map {
+public:
+  static constexpr id_handle empty = UINT32_MAX;
+
+  value *find(id_handle key) {
+    if (slots.empty()) {
+      return nullptr;
+    }
+    for (size_t i = bucket(key);; i = (i + 1) & mask()) {
+      if (slots[i].first == key) {
+        return &slots[i].second;
+      }
+      if (slots[i].first == empty) {
+        return nullptr;
+      }
+    }
+  }
+
+  value &operator[](id_handle key) {
+    if (auto res = find(key)) {
+      return *res;
+    }
+    if (2 * (used + 1) > slots.size()) {
+      rehash(std::max<size_t>(8, 2 * slots.size()));
+    }
+    size_t i = bucket(key);
+    while (slots[i].first != empty) {
+      i = (i + 1) & mask();
+    }
+    slots[i].first = key;
+    used++;
+    return slots[i].second;
+  }
+
+  bool erase(id_handle key) {
+    if (find(key) == nullptr) {
+      return false;
+    }
+    size_t i = bucket(key);
+    while (slots[i].first != key) {
+      i = (i + 1) & mask();
+    }
+    // pulls back later entries of the run so lookups never cross a hole
+    for (size_t j = (i + 1) & mask(); slots[j].first != empty;
+         j = (j + 1) & mask()) {
+      size_t home = bucket(slots[j].first);
+      if (((j - home) & mask()) >= ((j - i) & mask())) {
+        slots[i] = std::move(slots[j]);
+        i = j;
+      }
+    }
+    slots[i] = {empty, value()};
+    used--;
+    return true;
+  }
+
+  size_t size() const { return used; }
+
+  // f(id_handle, value &)
+  template <typename functor> void for_each(functor f) {
+    for (auto &i : slots) {
+      if (i.first != empty) {
+        f(i.first, i.second);
+      }
+    }
+  }
+
+private:
+  size_t mask() const { return slots.size() - 1; }
+
+  // fibonacci hashing spreads the dense handles over the table
+  size_t bucket(id_handle key) const {
+    return (uint64_t(key) * 0x9E3779B97F4A7C15ull >> 32) & mask();
+  }
+
+  void rehash(size_t capacity) {
+    std::vector<std::pair<id_handle, value>> old(capacity,
+                                                 {empty, value()});
+    old.swap(slots);
+    used = 0;
+    for (auto &i : old) {
+      if (i.first != empty) {
+        (*this)[i.first] = std::move(i.second);
+      }
+    }
+  }
+
+  std::vector<std::pair<id_handle, value>> slots;
+  size_t used = 0;
+};
+
+} // namespace messenger
+
+#endif
@@ -0,0 +1,100 @@
+#ifndef IO_POOL_H
+#define IO_POOL_H
+
+#include "boost/asio.hpp"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+namespace messenger {
+namespace network {
+
+// One io_context per thread, so reactors, timer queues and handler queues
+// are not shared between cores. State owned by a shard is only touched by
+// its thread, other shards post to it.
+class io_pool {
+public:
+  using work_guard =
+      boost::asio::executor_work_guard<boost::asio::io_context::executor_type>;
+
+  explicit io_pool(size_t count) {
+    for (size_t i = 0; i < std::max(count, size_t(1)); i++) {
+      contexts.push_back(std::make_unique<boost::asio::io_context>(1));
+      guards.push_back(boost::asio::make_work_guard(*contexts.back()));
+    }
+  }
+
+  ~io_pool() {
+    stop();
+    join();
+  }
+
+  size_t size() const { return contexts.size(); }
+
+  boost::asio::io_context &get(size_t i) { return *contexts[i % size()]; }
+
+  // round-robin, for accepted sockets
+  boost::asio::io_context &next() { return get(next_shard++); }
+
+  // the shard that owns key, e.g. a chat or a peer id
+  boost::asio::io_context &for_key(const std::string &key) {
+    return get(std::hash<std::string>{}(key));
+  }
+
+  // one thread per shard, pinned to core i where supported
+  void run() {
+    for (size_t i = 0; i < size(); i++) {
+      threads.emplace_back([this, i]() {
+        pin(i);
+        contexts[i]->run();
+      });
+    }
+  }
+
+  void stop() {
+    guards.clear();
+    for (auto &i : contexts) {
+      i->stop();
+    }
+  }
+
+  void join() {
+    for (auto &i : threads) {
+      if (i.joinable()) {
+        i.join();
+      }
+    }
+    threads.clear();
+  }
+
+private:
+  static void pin(size_t core) {
+#ifdef __linux__
+    auto cores = std::thread::hardware_concurrency();
+    if (cores == 0) {
+      return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core % cores, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+  }
+
+  std::vector<std::unique_ptr<boost::asio::io_context>> contexts;
+  std::vector<work_guard> guards;
+  std::vector<std::thread> threads;
+  std::atomic<size_t> next_shard{0};
+};
+
+} // namespace network
+} // namespace messenger
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef KEY_CACHE_H
+#define KEY_CACHE_H
+
+#include "crypto_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+namespace messenger {
+namespace network {
+
+// Sign keys of recent peers, parsed once. Entries are indexed by the SHA-256
+// of the raw bytes received and carry a verifier built from the key and its
+// key_fingerprint. The fingerprint hashes the key's canonical encoding, so it
+// is computed once on a miss rather than taken from the wire digest. The
+// least recently used entry is dropped above capacity. Entries are immutable
+// and shared, so a hit is one hash and one lookup instead of an ASN.1 parse.
+class key_cache {
+public:
+  using verifier_type =
+      CryptoPP::RSASS<CryptoPP::PSS, CryptoPP::SHA256>::Verifier;
+
+  struct entry {
+    explicit entry(CryptoPP::RSA::PublicKey k)
+        : key(std::move(k)), verifier(key) {}
+
+    bool verify(const CryptoPP::byte *data, uint64_t size,
+                const CryptoPP::byte *signature, uint64_t sig_size) const {
+      return verifier.VerifyMessage(data, size, signature, sig_size);
+    }
+
+    CryptoPP::RSA::PublicKey key;
+    verifier_type verifier;
+    digital_signature::key_fingerprint fingerprint;
+  };
+
+  struct counters {
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> evictions{0};
+  };
+
+  explicit key_cache(size_t max_entries = 256)
+      : capacity(std::max<size_t>(max_entries, 1)) {}
+
+  // parsed key of raw, throws like RSA::PublicKey::Load on malformed input
+  std::shared_ptr<const entry> get(const CryptoPP::byte *raw, uint64_t size) {
+    digital_signature::key_fingerprint digest;
+    CryptoPP::SHA256 sha;
+    sha.Update(raw, size);
+    sha.Final(digest.digest.data());
+    {
+      std::unique_lock ul{locker};
+      auto it = index.find(digest);
+      if (it != index.end()) {
+        stats.hits++;
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->second;
+      }
+    }
+    stats.misses++;
+    // parsed outside the lock, a racing miss on the same key just loses
+    CryptoPP::RSA::PublicKey key;
+    CryptoPP::ByteQueue bq;
+    bq.Put(raw, size);
+    key.Load(bq);
+    auto res = std::make_shared<entry>(std::move(key));
+    // a valid but non-canonical encoding hashes differently than Save()
+    res->fingerprint = digital_signature::fingerprint(res->key);
+
+    std::unique_lock ul{locker};
+    auto it = index.find(digest);
+    if (it != index.end()) {
+      return it->second->second;
+    }
+    lru.emplace_front(digest, res);
+    index.emplace(digest, lru.begin());
+    while (lru.size() > capacity) {
+      index.erase(lru.back().first);
+      lru.pop_back();
+      stats.evictions++;
+    }
+    return res;
+  }
+
+  const counters &get_stats() const { return stats; }
+
+  double hit_rate() const {
+    uint64_t total = stats.hits + stats.misses;
+    return total == 0 ? 0.0 : double(stats.hits) / total;
+  }
+
+  size_t size() {
+    std::unique_lock ul{locker};
+    return lru.size();
+  }
+
+private:
+  using lru_list = std::list<std::pair<digital_signature::key_fingerprint,
+                                       std::shared_ptr<const entry>>>;
+
+  size_t capacity;
+  lru_list lru; // most recent first
+  std::unordered_map<digital_signature::key_fingerprint, lru_list::iterator>
+      index;
+  std::mutex locker;
+  counters stats;
+};
+
+} // namespace network
+} // namespace messenger
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef KEY_POOL_H
+#define KEY_POOL_H
+
+#include "crypto_utils.h"
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <utility>
+#include <vector>
+#ifdef __linux__
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace messenger {
+namespace network {
+
+// Ephemeral rsa key pairs generated ahead of time by low priority worker
+// threads. Up to capacity pairs are kept ready, taking one is a pop. When
+// the pool runs dry the taker is queued and gets the next pair a worker
+// finishes, so key generation never runs on an io thread.
+class key_pool {
+public:
+  using key_pair =
+      std::pair<CryptoPP::RSA::PublicKey, CryptoPP::RSA::PrivateKey>;
+
+  struct counters {
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+    std::atomic<uint64_t> generated{0};
+  };
+
+  explicit key_pool(size_t capacity = 8, size_t workers = 1)
+      : capacity(std::max<size_t>(capacity, 1)) {
+    for (size_t i = 0; i < std::max<size_t>(workers, 1); i++) {
+      threads.emplace_back([this]() { work(); });
+    }
+  }
+
+  key_pool(const key_pool &) = delete;
+  key_pool &operator=(const key_pool &) = delete;
+
+  ~key_pool() {
+    {
+      std::unique_lock ul{locker};
+      stopped = true;
+    }
+    wakeup.notify_all();
+    for (auto &i : threads) {
+      i.join();
+    }
+  }
+
+  // a ready pair or nullopt, never blocks
+  std::optional<key_pair> try_take() {
+    std::unique_lock ul{locker};
+    if (ready.empty()) {
+      return std::nullopt;
+    }
+    auto res = std::move(ready.front());
+    ready.pop_front();
+    stats.hits++;
+    ul.unlock();
+    wakeup.notify_one();
+    return res;
+  }
+
+  // completes with a ready pair right away, or with the next generated one
+  // on the handler's executor when the pool is empty
+  template <typename token> auto async_take(token &&t) {
+    return boost::asio::async_initiate<token, void(key_pair)>(
+        [this](auto handler) {
+          std::unique_lock ul{locker};
+          if (!ready.empty()) {
+            auto res = std::move(ready.front());
+            ready.pop_front();
+            stats.hits++;
+            ul.unlock();
+            wakeup.notify_one();
+            complete(std::move(handler), std::move(res));
+            return;
+          }
+          stats.misses++;
+          waiters.push_back(
+              std::make_unique<waiter_impl<decltype(handler)>>(
+                  std::move(handler)));
+          ul.unlock();
+          wakeup.notify_one();
+        },
+        t);
+  }
+
+  size_t size() {
+    std::unique_lock ul{locker};
+    return ready.size();
+  }
+
+  const counters &get_stats() const { return stats; }
+
+private:
+  struct waiter {
+    virtual ~waiter() {}
+    virtual void complete(key_pair key) = 0;
+  };
+
+  template <typename handler_type> struct waiter_impl : waiter {
+    explicit waiter_impl(handler_type h)
+        : handler(std::move(h)),
+          guard(boost::asio::get_associated_executor(handler)) {}
+
+    void complete(key_pair key) override {
+      key_pool::complete(std::move(handler), std::move(key));
+    }
+
+    handler_type handler;
+    // keeps the handler's io_context running while it waits for a key
+    boost::asio::executor_work_guard<
+        boost::asio::associated_executor_t<handler_type>>
+        guard;
+  };
+
+  template <typename handler_type>
+  static void complete(handler_type handler, key_pair key) {
+    auto ex = boost::asio::get_associated_executor(handler);
+    boost::asio::post(
+        ex, [handler = std::move(handler), key = std::move(key)]() mutable {
+          handler(std::move(key));
+        });
+  }
+
+  void work() {
+    lower_priority();
+    // the shared generator in key_exchange is not thread safe
+    CryptoPP::AutoSeededRandomPool rng;
+    std::unique_lock ul{locker};
+    while (true) {
+      wakeup.wait(ul, [this]() {
+        return stopped || !waiters.empty() ||
+               ready.size() + pending < capacity;
+      });
+      if (stopped) {
+        return;
+      }
+      pending++;
+      ul.unlock();
+      auto key = key_exchange::generate_key(rng);
+      stats.generated++;
+      ul.lock();
+      pending--;
+      if (!waiters.empty()) {
+        auto w = std::move(waiters.front());
+        waiters.pop_front();
+        ul.unlock();
+        w->complete(std::move(key));
+        ul.lock();
+      } else {
+        ready.push_back(std::move(key));
+      }
+    }
+  }
+
+  // workers yield to the io threads, the pool is filled in idle time
+  static void lower_priority() {
+#ifdef __linux__
+    setpriority(PRIO_PROCESS, pid_t(syscall(SYS_gettid)), 10);
+#endif
+  }
+
+  size_t capacity;
+  size_t pending = 0; // pairs being generated for the ready queue
+  std::deque<key_pair> ready;
+  std::deque<std::unique_ptr<waiter>> waiters;
+  bool stopped = false;
+  std::mutex locker;
+  std::condition_variable wakeup;
+  counters stats;
+  std::vector<std::thread> threads;
+};
+
+} // namespace network
+} // namespace messenger
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef LATENCY_TRACKER_H
+#define LATENCY_TRACKER_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace messenger {
+
+// last window_size latency samples in milliseconds
+class latency_window {
+public:
+  static constexpr size_t window_size = 64;
+
+  void add(uint64_t ms) {
+    samples[next] = ms;
+    next = (next + 1) % window_size;
+    filled = std::min(filled + 1, window_size);
+  }
+
+  // p in [0, 1], nullopt without samples
+  std::optional<uint64_t> percentile(double p) const {
+    if (filled == 0) {
+      return std::nullopt;
+    }
+    std::array<uint64_t, window_size> sorted = samples;
+    auto rank = static_cast<size_t>(p * (filled - 1) + 0.5);
+    rank = std::min(rank, filled - 1);
+    std::nth_element(sorted.begin(), sorted.begin() + rank,
+                     sorted.begin() + filled);
+    return sorted[rank];
+  }
+
+  size_t count() const { return filled; }
+
+private:
+  std::array<uint64_t, window_size> samples{};
+  size_t next = 0;
+  size_t filled = 0;
+};
+
+// latency windows of peers numbered 0..n, not thread safe: paxos only
+// touches it on its chat's strand
+class latency_tracker {
+public:
+  void add(uint32_t peer, uint64_t ms) {
+    if (peer >= peers.size()) {
+      peers.resize(peer + 1);
+    }
+    peers[peer].add(ms);
+  }
+
+  std::optional<uint64_t> percentile(uint32_t peer, double p) const {
+    if (peer >= peers.size()) {
+      return std::nullopt;
+    }
+    return peers[peer].percentile(p);
+  }
+
+private:
+  std::vector<latency_window> peers;
+};
+
+} // namespace messenger
+
+#endif
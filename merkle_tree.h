@@ -0,0 +1,79 @@
+#ifndef MERKLE_TREE_H
+#define MERKLE_TREE_H
+
+#include "cryptopp/sha.h"
+#include <array>
+#include <optional>
+#include <vector>
+
+namespace messenger {
+
+// Binary Merkle tree built from the left as leaves are appended. Node
+// (level, index) covers leaves [index << level, (index + 1) << level) and
+// exists only once all of them are present.
+class merkle_tree {
+public:
+  using digest = std::array<unsigned char, CryptoPP::SHA256::DIGESTSIZE>;
+
+  void append_leaf(const digest &leaf) {
+    if (levels.empty()) {
+      levels.emplace_back();
+    }
+    levels[0].push_back(leaf);
+    for (uint64_t l = 0; levels[l].size() % 2 == 0; l++) {
+      if (l + 1 == levels.size()) {
+        levels.emplace_back();
+      }
+      auto n = levels[l].size();
+      levels[l + 1].push_back(parent(levels[l][n - 2], levels[l][n - 1]));
+    }
+  }
+
+  void truncate(uint64_t leaves) {
+    if (levels.empty() || leaves >= levels[0].size()) {
+      return;
+    }
+    levels[0].resize(leaves);
+    for (uint64_t l = 1; l < levels.size(); l++) {
+      levels[l].resize(levels[l - 1].size() / 2);
+    }
+  }
+
+  uint64_t leaf_count() const { return levels.empty() ? 0 : levels[0].size(); }
+
+  std::optional<digest> node(uint32_t level, uint64_t index) const {
+    if (level >= levels.size() || index >= levels[level].size()) {
+      return std::nullopt;
+    }
+    return levels[level][index];
+  }
+
+  // largest complete subtrees covering leaves [0, leaves), left to right
+  static std::vector<std::pair<uint32_t, uint64_t>> peaks(uint64_t leaves) {
+    std::vector<std::pair<uint32_t, uint64_t>> res;
+    uint64_t covered = 0;
+    for (int level = 63; level >= 0; level--) {
+      if (leaves & (uint64_t(1) << level)) {
+        res.emplace_back(level, covered >> level);
+        covered += uint64_t(1) << level;
+      }
+    }
+    return res;
+  }
+
+private:
+  static digest parent(const digest &left, const digest &right) {
+    CryptoPP::SHA256 sha;
+    sha.Update(left.data(), left.size());
+    sha.Update(right.data(), right.size());
+    digest res;
+    sha.Final(res.data());
+    return res;
+  }
+
+  std::vector<std::vector<digest>> levels;
+};
+
+} // namespace messenger
+
+#endif
@@ -3,317 +3,304 @@
 #include "boost/asio.hpp"
 #include "crypto_utils.h"
 #include "deserializer.h"
+#include "frame_pool.h"
+#include "key_cache.h"
+#include "key_pool.h"
+#include "session_cache.h"
+#include <array>
+#include <exception>
+#include <optional>
 #include <string>
+#include <tuple>
+#include <vector>
 
 namespace messenger {
 namespace network {
 
+template <typename serv_type, typename functor>
+void send_session_dialog_msg(serv_type *serv, std::string id, std::string text,
+                             CryptoPP::RSA::PublicKey sign_publicKey,
+                             session_cache::outbound_ticket ticket,
+                             functor handler) {
+  messenger::network_packets::dialog_text pack;
+  pack.id = std::move(sign_publicKey);
+  pack.text = std::move(text);
+  auto res = messenger::deserializer::serialize(pack);
+  if (res.first == nullptr) {
+    handler(boost::system::errc::make_error_code(boost::system::errc::io_error));
+    return;
+  }
+
+  uint64_t cipher_size = res.second;
+  uint64_t header_len = sizeof(uint64_t) + 1 + session_cache::session_id_len +
+                        sizeof(ticket.seq) + sizeof(cipher_size);
+  uint64_t total_len = header_len + cipher_size;
+  uint64_t frame_len = total_len - sizeof(frame_len);
+  std::shared_ptr<char[]> data(new char[total_len]);
+  messenger::writer data_writer(data.get(), total_len);
+  char msg_type = messenger::network_type::dialog_session_text;
+  data_writer.writer_sequentially((char *)(&frame_len), sizeof(frame_len));
+  data_writer.writer_sequentially(&msg_type, sizeof(msg_type));
+  data_writer.writer_sequentially(ticket.session_id.data(),
+                                  session_cache::session_id_len);
+  data_writer.writer_sequentially((char *)(&ticket.seq), sizeof(ticket.seq));
+  data_writer.writer_sequentially((char *)(&cipher_size), sizeof(cipher_size));
+
+  // encrypt straight into the outgoing packet
+  auto iv = session_cache::message_iv(ticket.iv, ticket.seq);
+  CryptoPP::Salsa20::Encryption enc;
+  enc.SetKeyWithIV(ticket.key, ticket.key.size(), iv, iv.size());
+  enc.ProcessData((CryptoPP::byte *)data.get() + header_len,
+                  (const CryptoPP::byte *)res.first.get(), cipher_size);
+
+  serv->async_send(data, total_len, id,
+                   [handler](const boost::system::error_code &ec) {
+                     handler(ec);
+                   });
+}
+
+// error carried by a finished coroutine, io_error for foreign exceptions
+inline boost::system::error_code error_from(std::exception_ptr e) {
+  if (!e) {
+    return boost::system::error_code();
+  }
+  try {
+    std::rethrow_exception(e);
+  } catch (const boost::system::system_error &err) {
+    return err.code();
+  } catch (...) {
+    return boost::system::errc::make_error_code(boost::system::errc::io_error);
+  }
+}
+
+[[noreturn]] inline void throw_bad_message() {
+  throw boost::system::system_error(
+      boost::system::errc::make_error_code(boost::system::errc::bad_message));
+}
+
+// signs data with the sender key: [key_len][hash_len][data_len][key][hash]
+// [data], prefixed by a frame header when msg_type is set
+inline std::vector<char>
+signed_frame(std::shared_ptr<unsigned char[]> data, uint64_t size,
+             const CryptoPP::RSA::PrivateKey &sign_privateKey,
+             const CryptoPP::RSA::PublicKey &sign_publicKey,
+             std::optional<char> msg_type) {
+  salsa20::sign_obj signed_data =
+      digital_signature::sign(data, size, sign_privateKey, sign_publicKey);
+  uint64_t key_len = signed_data.public_key_size;
+  uint64_t hash_size = signed_data.hash.size();
+  uint64_t data_len = signed_data.data_size;
+  uint64_t header_len = msg_type ? sizeof(uint64_t) + 1 : 0;
+  uint64_t total_len = header_len + sizeof(key_len) + sizeof(hash_size) +
+                       sizeof(data_len) + key_len + hash_size + data_len;
+  std::vector<char> res(total_len);
+  messenger::writer data_writer(res.data(), total_len);
+  if (msg_type) {
+    uint64_t frame_len = total_len - sizeof(frame_len);
+    data_writer.writer_sequentially((char *)(&frame_len), sizeof(frame_len));
+    data_writer.writer_sequentially(&*msg_type, 1);
+  }
+  data_writer.writer_sequentially((char *)(&key_len), sizeof(key_len));
+  data_writer.writer_sequentially((char *)(&hash_size), sizeof(hash_size));
+  data_writer.writer_sequentially((char *)(&data_len), sizeof(data_len));
+  data_writer.writer_sequentially((char *)signed_data.public_key.get(),
+                                  key_len);
+  data_writer.writer_sequentially(signed_data.hash.c_str(), hash_size);
+  if (!data_writer.writer_sequentially((char *)signed_data.data.get(),
+                                       data_len)) {
+    throw boost::system::system_error(
+        boost::system::errc::make_error_code(boost::system::errc::io_error));
+  }
+  return res;
+}
+
+// reads the signed, rsa encrypted salsa key and iv sent in reply to our rsa
+// key, returns the signer's fingerprint, iv and key
+inline boost::asio::awaitable<
+    std::tuple<digital_signature::key_fingerprint, CryptoPP::SecByteBlock,
+               CryptoPP::SecByteBlock>>
+accept_cryped_signed_salsa_key(
+    std::shared_ptr<boost::asio::ip::tcp::socket> sock,
+    CryptoPP::RSA::PrivateKey decrypt_rsa_key, frame_pool &frames,
+    key_cache &sign_keys) {
+  std::array<uint64_t, 3> lens{};
+  co_await boost::asio::async_read(
+      *sock, boost::asio::buffer(lens), boost::asio::use_awaitable);
+  auto [public_key_len, hash_len, data_len] = lens;
+  constexpr uint64_t limit = 1 << 20; // keys and signatures are a few kb
+  if (public_key_len > limit || hash_len > limit || data_len > limit) {
+    throw_bad_message();
+  }
+  uint64_t raw_len = public_key_len + hash_len + data_len;
+  auto raw_data = frames.acquire(raw_len);
+  co_await boost::asio::async_read(*sock,
+                                   boost::asio::buffer(raw_data.get(), raw_len),
+                                   boost::asio::use_awaitable);
+
+  // key, signature and signed data are parsed where they were read
+  auto raw = (CryptoPP::byte *)raw_data.get();
+  auto signer = sign_keys.get(raw, public_key_len);
+  CryptoPP::byte *signed_data = raw + public_key_len + hash_len;
+  if (!signer->verify(signed_data, data_len, raw + public_key_len,
+                      hash_len)) {
+    throw_bad_message();
+  }
+
+  std::stringstream ss_format_data;
+  ss_format_data << std::string((char *)signed_data, data_len);
+  CryptoPP::Integer cipher_info;
+  ss_format_data >> cipher_info;
+  auto salsa_key_and_iv =
+      key_exchange::rsa_decrypt(cipher_info, decrypt_rsa_key);
+  CryptoPP::SecByteBlock iv(8);
+  CryptoPP::SecByteBlock key(16);
+  if (salsa_key_and_iv.second < int64_t(iv.size() + key.size())) {
+    throw_bad_message();
+  }
+  std::memcpy(iv, salsa_key_and_iv.first.get(), iv.size());
+  std::memcpy(key, salsa_key_and_iv.first.get() + iv.size(), key.size());
+  co_return std::make_tuple(signer->fingerprint, std::move(iv),
+                            std::move(key));
+}
+
+// client side of the dialog handshake on a connected socket: sends a signed
+// ephemeral rsa key, gets the salsa key back and sends the encrypted text
+template <typename serv_type>
+boost::asio::awaitable<void>
+send_dialog_handshake(serv_type *serv,
+                      std::shared_ptr<boost::asio::ip::tcp::socket> sock,
+                      std::string id,
+                      digital_signature::key_fingerprint recipient,
+                      std::string text, CryptoPP::RSA::PublicKey sign_publicKey,
+                      CryptoPP::RSA::PrivateKey sign_privateKey) {
+  auto rsa_key = co_await serv->get_rsa_keys().async_take(
+      boost::asio::use_awaitable);
+  auto raw_key = key_exchange::rsa_key_to_bytes(rsa_key.first);
+  auto data =
+      signed_frame(raw_key.first, raw_key.second, sign_privateKey,
+                   sign_publicKey, char(messenger::network_type::dialog_text));
+  co_await boost::asio::async_write(*sock, boost::asio::buffer(data),
+                                    boost::asio::use_awaitable);
+
+  auto [peer, salsa_iv, salsa_key] =
+      co_await accept_cryped_signed_salsa_key(
+          sock, rsa_key.second, serv->get_frames(), serv->get_sign_keys());
+  if (peer != recipient) {
+    throw_bad_message();
+  }
+
+  messenger::network_packets::dialog_text pack;
+  pack.id = std::move(sign_publicKey);
+  pack.text = std::move(text);
+  auto res = messenger::deserializer::serialize(pack);
+  if (res.first == nullptr) {
+    throw boost::system::system_error(
+        boost::system::errc::make_error_code(boost::system::errc::io_error));
+  }
+  salsa20::cipher_info crypted_text_pack = salsa20::salsa20_encrypt(
+      salsa_iv, salsa_key, (unsigned char *)res.first.get(), res.second);
+  uint64_t cipher_size = crypted_text_pack.cipher_size;
+  std::array<boost::asio::const_buffer, 2> buffers{
+      boost::asio::buffer(&cipher_size, sizeof(cipher_size)),
+      boost::asio::buffer(crypted_text_pack.cipher.get(), cipher_size)};
+  co_await boost::asio::async_write(*sock, buffers,
+                                    boost::asio::use_awaitable);
+  serv->get_sessions().store_outbound(recipient, id, crypted_text_pack.iv,
+                                      crypted_text_pack.key);
+}
+
+// recipient is the fingerprint of the recipient's sign key, the handshake
+// fails if another key answers
 template <typename serv_type, typename functor>
 void send_dialog_msg(serv_type *serv, std::string id, std::string text,
                      CryptoPP::RSA::PublicKey sign_publicKey,
                      CryptoPP::RSA::PrivateKey sign_privateKey,
-                     CryptoPP::RSA::PublicKey recipient_public_sign_key,
+                     digital_signature::key_fingerprint recipient,
                      functor handler) {
+  auto ticket = serv->get_sessions().acquire(recipient, text);
+  if (ticket) {
+    send_session_dialog_msg(serv, id, std::move(text),
+                            std::move(sign_publicKey), std::move(*ticket),
+                            handler);
+    return;
+  }
 
   serv->async_connect(id, [=](boost::asio::ip::tcp::socket conn_sock,
                               boost::system::error_code ec) {
-    std::shared_ptr<boost::asio::ip::tcp::socket> sock(
-        std::make_shared<boost::asio::ip::tcp::socket>(std::move(conn_sock)));
     if (ec) {
       handler(ec);
       return;
     }
-
-    auto rsa_key = key_exchange::generate_key();
-    auto rsa_key_for_send = rsa_key.first;
-
-    CryptoPP::ByteQueue queue;
-    rsa_key_for_send.Save(queue);
-    CryptoPP::lword size = queue.TotalBytesRetrievable();
-    std::shared_ptr<CryptoPP::byte[]> buf(new CryptoPP::byte[size]);
-    queue.Get(buf.get(), size);
-
-    salsa20::sign_obj signed_data =
-        digital_signature::sign(std::static_pointer_cast<unsigned char[]>(buf),
-                                size, sign_privateKey, sign_publicKey);
-
-    uint64_t key_len = signed_data.public_key_size;
-    uint64_t hash_size = signed_data.hash.size();
-    uint64_t data_len = signed_data.data_size;
-    uint64_t total_len = 1 + sizeof(key_len) + sizeof(hash_size) +
-                         sizeof(data_len) + key_len + hash_size + data_len;
-    std::shared_ptr<char[]> data(new char[total_len]);
-    messenger::writer data_writer(data.get(), total_len);
-    char msg_type = messenger::network_type::dialog_text;
-    data_writer.writer_sequentially(&msg_type, sizeof(msg_type));
-    data_writer.writer_sequentially((char *)(&key_len), sizeof(key_len));
-    data_writer.writer_sequentially((char *)(&hash_size), sizeof(hash_size));
-    data_writer.writer_sequentially((char *)(&data_len), sizeof(data_len));
-    data_writer.writer_sequentially((char *)signed_data.public_key.get(),
-                                    key_len);
-    data_writer.writer_sequentially(signed_data.hash.c_str(), hash_size);
-    bool res = data_writer.writer_sequentially((char *)signed_data.data.get(),
-                                               data_len);
-    if (!res) {
-      handler(
-          boost::system::errc::make_error_code(boost::system::errc::io_error));
-      return;
-    }
-    boost::asio::async_write(
-        *sock, boost::asio::buffer(data.get(), total_len),
-        [data, handler, sock, rsa_decrypt_key = rsa_key.second, sign_publicKey,
-         text,
-         recipient_public_sign_key](boost::system::error_code ec, uint64_t) {
-          if (!ec) {
-            accept_cryped_signed_salsa_key(
-                sock, rsa_decrypt_key,
-                [handler, sign_publicKey = std::move(sign_publicKey),
-                 text = std::move(text), sock, recipient_public_sign_key](
-                    boost::system::error_code ec, bool if_valid,
-                    CryptoPP::RSA::PublicKey accepted_piblic_key_for_sign,
-                    CryptoPP::SecByteBlock salsa_iv,
-                    CryptoPP::SecByteBlock salsa_key) {
-                  if (!ec) {
-                    if (digital_signature::compare_keys(
-                            accepted_piblic_key_for_sign,
-                            recipient_public_sign_key)) {
-                      messenger::network_packets::dialog_text pack;
-                      pack.id = sign_publicKey;
-                      pack.text = std::move(text);
-                      auto res = messenger::deserializer::serialize(pack);
-                      salsa20::cipher_info crypted_text_pack =
-                          salsa20::salsa20_encrypt(
-                              salsa_iv, salsa_key,
-                              (unsigned char *)res.first.get(), res.second);
-                      std::shared_ptr<uint64_t> cipher_size(
-                          new uint64_t(crypted_text_pack.cipher_size));
-                      std::shared_ptr<std::vector<boost::asio::const_buffer>>
-                          buffers(new std::vector<boost::asio::const_buffer>);
-                      buffers->push_back(boost::asio::buffer(
-                          cipher_size.get(), sizeof(*cipher_size)));
-                      buffers->push_back(boost::asio::buffer(
-                          crypted_text_pack.cipher.get(), *cipher_size));
-
-                      boost::asio::async_write(
-                          *sock, *buffers,
-                          [sock, buffers, cipher_size, crypted_text_pack,
-                           handler](boost::system::error_code ec, uint64_t) {
-                            handler(ec);
-                          });
-                    } else {
-                      handler(boost::system::errc::make_error_code(
-                          boost::system::errc::bad_message));
-                    }
-
-                  } else {
-                    handler(ec);
-                  }
-                });
-          } else {
-            handler(ec);
-          }
-        });
+    auto sock =
+        std::make_shared<boost::asio::ip::tcp::socket>(std::move(conn_sock));
+    auto ex = sock->get_executor();
+    boost::asio::co_spawn(
+        ex,
+        send_dialog_handshake(serv, std::move(sock), id, recipient, text,
+                              sign_publicKey, sign_privateKey),
+        [handler](std::exception_ptr e) { handler(error_from(e)); });
   });
 }
 
-template <typename functor>
-void accept_cryped_signed_salsa_key(
-    std::shared_ptr<boost::asio::ip::tcp::socket> sock,
-    CryptoPP::RSA::PrivateKey decrypt_rsa_key, functor handler) {
-  std::shared_ptr<char[]> lens(new char[3 * sizeof(uint64_t)]);
-  boost::asio::async_read(
-      *sock, boost::asio::buffer(lens.get(), 3 * sizeof(uint64_t)),
-      [sock, lens, handler, decrypt_rsa_key](boost::system::error_code ec,
-                                             uint64_t) {
-        if (ec) {
-          handler(ec, false, CryptoPP::RSA::PublicKey(),
-                  CryptoPP::SecByteBlock(8), CryptoPP::SecByteBlock(16));
-        } else {
-          uint64_t public_key_len = 0;
-          uint64_t hash_len = 0;
-          uint64_t data_len = 0;
-          std::memcpy(&public_key_len, lens.get(), sizeof(public_key_len));
-          std::memcpy(&hash_len, lens.get() + sizeof(public_key_len),
-                      sizeof(hash_len));
-          std::memcpy(&data_len,
-                      lens.get() + sizeof(public_key_len) + sizeof(hash_len),
-                      sizeof(data_len));
-          std::shared_ptr<char[]> raw_data(
-              new char[public_key_len + hash_len + data_len]);
-          boost::asio::async_read(
-              *sock,
-              boost::asio::buffer(raw_data.get(),
-                                  public_key_len + hash_len + data_len),
-              [sock, public_key_len, hash_len, data_len, raw_data, handler,
-               decrypt_rsa_key](boost::system::error_code ec, uint64_t) {
-                if (!ec) {
-                  salsa20::sign_obj rsa_sign_key;
-                  rsa_sign_key.data_size = data_len;
-                  rsa_sign_key.public_key_size = public_key_len;
-                  rsa_sign_key.data = std::shared_ptr<CryptoPP::byte[]>(
-                      new CryptoPP::byte[data_len]);
-                  rsa_sign_key.public_key = std::shared_ptr<CryptoPP::byte[]>(
-                      new CryptoPP::byte[public_key_len]);
-                  std::memcpy(rsa_sign_key.public_key.get(), raw_data.get(),
-                              public_key_len);
-                  std::unique_ptr<char[]> hash_str(new char[public_key_len]);
-                  std::memcpy(hash_str.get(), raw_data.get() + public_key_len,
-                              hash_len);
-                  rsa_sign_key.hash = std::string(hash_str.get(), hash_len);
-                  std::memcpy(rsa_sign_key.data.get(),
-                              raw_data.get() + public_key_len + hash_len,
-                              data_len);
-
-                  /// //////////////////////////
-                  CryptoPP::RSA::PublicKey public_key_for_signature;
-                  CryptoPP::SecByteBlock signature =
-                      salsa20::string_to_secblock(rsa_sign_key.hash);
-                  CryptoPP::ByteQueue bq;
-                  bq.Put(rsa_sign_key.public_key.get(),
-                         rsa_sign_key.public_key_size);
-                  public_key_for_signature.Load(bq);
-
-                  std::string tmp((char *)(rsa_sign_key.data.get()),
-                                  rsa_sign_key.data_size);
-                  std::stringstream ss_format_data;
-                  ss_format_data << tmp;
-                  CryptoPP::Integer cipher_info;
-                  ss_format_data >> cipher_info;
-                  // need to parse and get two secbyteblocks
-                  auto salsa_key_and_iv =
-                      key_exchange::rsa_decrypt(cipher_info, decrypt_rsa_key);
-                  bool res = digital_signature::verify(
-                      static_cast<unsigned char *>(rsa_sign_key.data.get()),
-                      rsa_sign_key.data_size, public_key_for_signature,
-                      signature);
-                  if (res) {
-                    CryptoPP::SecByteBlock iv(8);
-                    CryptoPP::SecByteBlock key(16);
-                    std::memcpy(iv, salsa_key_and_iv.first.get(), iv.size());
-                    std::memcpy(key, salsa_key_and_iv.first.get() + iv.size(),
-                                key.size());
-                    handler(boost::system::errc::make_error_code(
-                                boost::system::errc::success),
-                            res, public_key_for_signature, iv, key);
-                  } else {
-                    handler(boost::system::errc::make_error_code(
-                                boost::system::errc::bad_message),
-                            res, public_key_for_signature,
-                            CryptoPP::SecByteBlock(8),
-                            CryptoPP::SecByteBlock(16));
-                  }
-                } else {
-                  handler(ec, false, CryptoPP::RSA::PublicKey(),
-                          CryptoPP::SecByteBlock(8),
-                          CryptoPP::SecByteBlock(16));
-                }
-              });
-        }
-      });
-}
+// parses the first dialog_text frame, returns the sender's cached sign key
+// and the ephemeral rsa key it signed
+inline std::pair<std::shared_ptr<const key_cache::entry>,
+                 CryptoPP::RSA::PublicKey>
+accept_signed_rsa_key(const char *frame, uint64_t frame_len,
+                      key_cache &sign_keys) {
+  messenger::reader data_reader(frame, frame_len);
+  char msg_type = 0;
+  uint64_t public_key_len = 0;
+  uint64_t hash_len = 0;
+  uint64_t data_len = 0;
+  data_reader.read_sequentially(&msg_type, sizeof(msg_type));
+  data_reader.read_sequentially((char *)(&public_key_len),
+                                sizeof(public_key_len));
+  data_reader.read_sequentially((char *)(&hash_len), sizeof(hash_len));
+  bool res =
+      data_reader.read_sequentially((char *)(&data_len), sizeof(data_len));
+  uint64_t rest = data_reader.get_limit() - data_reader.get_pointer();
+  if (!res || public_key_len > rest || hash_len > rest - public_key_len ||
+      data_len != rest - public_key_len - hash_len) {
+    throw_bad_message();
+  }
+  auto raw_data = (const CryptoPP::byte *)data_reader.get_pointer();
 
-template <typename functor>
-void accept_signed_rsa_key(
-    std::shared_ptr<boost::asio::ip::tcp::socket> sock,
-    functor handler) { // boost::system::error_code ec res, id, rsa_key
-  std::shared_ptr<char[]> lens(new char[3 * sizeof(uint64_t)]);
-  using namespace boost::asio;
-  async_read(
-      *sock, boost::asio::buffer(lens.get(), 3 * sizeof(uint64_t)),
-      [sock, lens, handler](boost::system::error_code ec, uint64_t) {
-        if (!ec) {
-          uint64_t public_key_len = 0;
-          uint64_t hash_len = 0;
-          uint64_t data_len = 0;
-          std::memcpy(&public_key_len, lens.get(), sizeof(public_key_len));
-          std::memcpy(&hash_len, lens.get() + sizeof(public_key_len),
-                      sizeof(hash_len));
-          std::memcpy(&data_len,
-                      lens.get() + sizeof(public_key_len) + sizeof(hash_len),
-                      sizeof(data_len));
-          std::shared_ptr<char[]> raw_data(
-              new char[public_key_len + hash_len + data_len]);
-          async_read(
-              *sock,
-              boost::asio::buffer(raw_data.get(),
-                                  public_key_len + hash_len + data_len),
-              [sock, public_key_len, hash_len, data_len, raw_data,
-               handler](boost::system::error_code ec, uint64_t) {
-                if (!ec) {
-                  salsa20::sign_obj rsa_sign_key;
-                  rsa_sign_key.data_size = data_len;
-                  rsa_sign_key.public_key_size = public_key_len;
-                  rsa_sign_key.data = std::shared_ptr<CryptoPP::byte[]>(
-                      new CryptoPP::byte[data_len]);
-                  rsa_sign_key.public_key = std::shared_ptr<CryptoPP::byte[]>(
-                      new CryptoPP::byte[public_key_len]);
-                  std::memcpy(rsa_sign_key.public_key.get(), raw_data.get(),
-                              public_key_len);
-                  std::unique_ptr<char[]> hash_str(new char[public_key_len]);
-                  std::memcpy(hash_str.get(), raw_data.get() + public_key_len,
-                              hash_len);
-                  rsa_sign_key.hash = std::string(hash_str.get(), hash_len);
-                  std::memcpy(rsa_sign_key.data.get(),
-                              raw_data.get() + public_key_len + hash_len,
-                              data_len);
-
-                  CryptoPP::RSA::PublicKey public_key_for_signature;
-                  CryptoPP::SecByteBlock signature =
-                      salsa20::string_to_secblock(rsa_sign_key.hash);
-                  CryptoPP::ByteQueue bq;
-                  bq.Put(rsa_sign_key.public_key.get(),
-                         rsa_sign_key.public_key_size);
-                  public_key_for_signature.Load(bq);
-                  //
-                  CryptoPP::ByteQueue bq2;
-                  bq2.Put(rsa_sign_key.data.get(), rsa_sign_key.data_size);
-                  CryptoPP::RSA::PublicKey rsa_public_key;
-                  rsa_public_key.Load(bq2);
-
-                  bool res = digital_signature::verify(
-                      rsa_sign_key.data.get(), rsa_sign_key.data_size,
-                      public_key_for_signature, signature);
-                  if (res) {
-                    handler(boost::system::errc::make_error_code(
-                                boost::system::errc::success),
-                            public_key_for_signature, rsa_public_key);
-                  } else {
-                    handler(boost::system::errc::make_error_code(
-                                boost::system::errc::bad_message),
-                            CryptoPP::RSA::PublicKey(),
-                            CryptoPP::RSA::PublicKey());
-                  }
-
-                } else {
-                  handler(ec, CryptoPP::RSA::PublicKey(),
-                          CryptoPP::RSA::PublicKey());
-                }
-              });
-        } else {
-          handler(ec, CryptoPP::RSA::PublicKey(), CryptoPP::RSA::PublicKey());
-        }
-      });
+  auto sender = sign_keys.get(raw_data, public_key_len);
+  // the ephemeral key is new on every handshake and is not cached
+  CryptoPP::ByteQueue bq2;
+  bq2.Put(raw_data + public_key_len + hash_len, data_len);
+  CryptoPP::RSA::PublicKey rsa_public_key;
+  rsa_public_key.Load(bq2);
+
+  if (!sender->verify(raw_data + public_key_len + hash_len, data_len,
+                      raw_data + public_key_len, hash_len)) {
+    throw_bad_message();
+  }
+  return {std::move(sender), std::move(rsa_public_key)};
 }
 
-template <typename functor>
-void send_crypted_signed_salsa_key(
+// encrypts a fresh salsa key and iv with rsa_key, signs and sends them,
+// returns the iv and key
+inline boost::asio::awaitable<
+    std::pair<CryptoPP::SecByteBlock, CryptoPP::SecByteBlock>>
+send_crypted_signed_salsa_key(
     std::shared_ptr<boost::asio::ip::tcp::socket> sock,
     CryptoPP::RSA::PublicKey public_sign_key,
     CryptoPP::RSA::PrivateKey private_sign_key,
-    CryptoPP::RSA::PublicKey rsa_key, functor handler) {
+    CryptoPP::RSA::PublicKey rsa_key) {
   CryptoPP::AutoSeededRandomPool prng;
   CryptoPP::SecByteBlock salsa_key(16);
   CryptoPP::SecByteBlock salsa_iv(8);
   prng.GenerateBlock(salsa_iv, salsa_iv.size());
   prng.GenerateBlock(salsa_key, salsa_key.size());
 
-  std::shared_ptr<unsigned char[]> raw_salsa(new unsigned char[24]);
-  std::memcpy(raw_salsa.get(), salsa_iv.data(),
-              salsa_iv.size()); // must be 16
-  std::memcpy(raw_salsa.get() + salsa_iv.size(), salsa_key.data(),
+  std::array<unsigned char, 24> raw_salsa;
+  std::memcpy(raw_salsa.data(), salsa_iv.data(), salsa_iv.size());
+  std::memcpy(raw_salsa.data() + salsa_iv.size(), salsa_key.data(),
               salsa_key.size());
   auto crypted_salsa_key =
-      key_exchange::rsa_encrypt(raw_salsa.get(), 24, rsa_key);
+      key_exchange::rsa_encrypt(raw_salsa.data(), raw_salsa.size(), rsa_key);
   std::stringstream ss;
   ss << crypted_salsa_key;
   std::string salsa_str = ss.str();
@@ -321,124 +308,161 @@ void send_crypted_signed_salsa_key(
 
   std::shared_ptr<unsigned char[]> raw_str(new unsigned char[len]);
   std::memcpy(raw_str.get(), salsa_str.data(), len);
-  auto signed_data =
-      digital_signature::sign(raw_str, len, private_sign_key, public_sign_key);
+  auto data = signed_frame(raw_str, len, private_sign_key, public_sign_key,
+                           std::nullopt);
+  co_await boost::asio::async_write(*sock, boost::asio::buffer(data),
+                                    boost::asio::use_awaitable);
+  co_return std::make_pair(std::move(salsa_iv), std::move(salsa_key));
+}
 
-  uint64_t key_len = signed_data.public_key_size;
-  uint64_t hash_size = signed_data.hash.size();
-  uint64_t data_len = signed_data.data_size;
-  uint64_t total_len = sizeof(key_len) + sizeof(hash_size) + sizeof(data_len) +
-                       key_len + hash_size + data_len;
-  std::shared_ptr<char[]> data(new char[total_len]);
-  messenger::writer data_writer(data.get(), total_len);
-  data_writer.writer_sequentially((char *)(&key_len), sizeof(key_len));
-  data_writer.writer_sequentially((char *)(&hash_size), sizeof(hash_size));
-  data_writer.writer_sequentially((char *)(&data_len), sizeof(data_len));
-  data_writer.writer_sequentially((char *)signed_data.public_key.get(),
-                                  key_len);
-  data_writer.writer_sequentially(signed_data.hash.c_str(), hash_size);
-  bool res =
-      data_writer.writer_sequentially((char *)signed_data.data.get(), data_len);
-  if (!res) {
-    handler(boost::system::errc::make_error_code(boost::system::errc::io_error),
-            salsa_iv, salsa_key);
-  } else {
-    boost::asio::async_write(*sock, boost::asio::buffer(data.get(), total_len),
-                             [sock, data, salsa_iv, salsa_key,
-                              handler](boost::system::error_code ec, uint64_t) {
-                               handler(ec, salsa_iv, salsa_key);
-                             });
+// reads one [size][cipher] message into a pooled buffer, decrypted in place
+inline boost::asio::awaitable<std::pair<std::shared_ptr<char[]>, uint64_t>>
+accept_salsa_crypted_data(std::shared_ptr<boost::asio::ip::tcp::socket> sock,
+                          const CryptoPP::SecByteBlock &iv,
+                          const CryptoPP::SecByteBlock &key,
+                          frame_pool &frames, uint64_t max_size) {
+  uint64_t size = 0;
+  co_await boost::asio::async_read(*sock,
+                                   boost::asio::buffer(&size, sizeof(size)),
+                                   boost::asio::use_awaitable);
+  if (size > max_size) {
+    throw_bad_message();
   }
+  auto data = frames.acquire(size);
+  co_await boost::asio::async_read(*sock, boost::asio::buffer(data.get(), size),
+                                   boost::asio::use_awaitable);
+  CryptoPP::Salsa20::Decryption dec;
+  dec.SetKeyWithIV(key, key.size(), iv, iv.size());
+  dec.ProcessData((unsigned char *)data.get(), (unsigned char *)data.get(),
+                  size);
+  co_return std::make_pair(std::move(data), size);
 }
 
-template <typename functor> // fuctor(error, size, data)
-void accept_salsa_crypted_data(
+// an accepted text with the fingerprint its sender was verified against
+struct received_text {
+  network_packets::dialog_text text;
+  digital_signature::key_fingerprint sender;
+};
+
+// server side of the dialog handshake, frame is the first dialog_text frame
+// read from sock. Returns nullopt if the text was signed by another key
+inline boost::asio::awaitable<std::optional<received_text>>
+accept_dialog_msg(
     std::shared_ptr<boost::asio::ip::tcp::socket> sock,
-    CryptoPP::SecByteBlock iv, CryptoPP::SecByteBlock key, functor handler) {
-  std::shared_ptr<uint64_t> size(new uint64_t(0));
-  boost::asio::async_read(
-      *sock, boost::asio::buffer(size.get(), sizeof(*size)),
-      [size, sock, handler, key = std::move(key),
-       iv = std::move(iv)](boost::system::error_code ec, uint64_t) {
-        if (!ec) {
-
-          std::shared_ptr<char[]> data(new char[*size]);
-
-          boost::asio::async_read(
-              *sock, boost::asio::buffer(data.get(), *size),
-              [sock, data, handler, size, key = std::move(key),
-               iv = std::move(iv)](boost::system::error_code ec, uint64_t) {
-                if (!ec) {
-                  CryptoPP::Salsa20::Decryption dec;
-                  dec.SetKeyWithIV(key, key.size(), iv, iv.size());
-                  std::shared_ptr<char[]> decrypted_data(new char[*size]);
-                  dec.ProcessData((unsigned char *)decrypted_data.get(),
-                                  (unsigned char *)data.get(), *size);
-
-                  handler(boost::system::errc::make_error_code(
-                              boost::system::errc::success),
-                          decrypted_data, *size);
-                } else {
-                  handler(ec, nullptr, 0);
-                }
-              });
-
-        } else {
-          handler(ec, nullptr, 0);
-        }
-      });
+    std::shared_ptr<char[]> frame, uint64_t frame_len,
+    std::pair<CryptoPP::RSA::PublicKey, CryptoPP::RSA::PrivateKey> my_sign_keys,
+    session_cache &sessions, key_cache &sign_keys, frame_pool &frames,
+    uint64_t max_size) {
+  auto [sender, rsa_key] =
+      accept_signed_rsa_key(frame.get(), frame_len, sign_keys);
+  frame.reset();
+  auto [salsa_iv, salsa_key] = co_await send_crypted_signed_salsa_key(
+      sock, std::move(my_sign_keys.first), std::move(my_sign_keys.second),
+      std::move(rsa_key));
+  auto [data, size] = co_await accept_salsa_crypted_data(
+      sock, salsa_iv, salsa_key, frames, max_size);
+
+  auto accepted_text_pack = messenger::deserializer::deserialize(data, size);
+  auto res =
+      std::get_if<messenger::network_packets::dialog_text>(&accepted_text_pack);
+  if (res == nullptr) {
+    throw_bad_message();
+  }
+  if (!digital_signature::compare_keys(sender->fingerprint, res->id)) {
+    co_return std::nullopt;
+  }
+  sessions.store_inbound(salsa_iv, salsa_key, sender->fingerprint);
+  co_return received_text{std::move(*res), sender->fingerprint};
 }
 
 template <typename functor>
-void accept_dialog_msg(
-    std::shared_ptr<boost::asio::ip::tcp::socket> sock,
-    std::pair<CryptoPP::RSA::PublicKey, CryptoPP::RSA::PrivateKey> my_sign_keys,
-    functor handler) {
-  accept_signed_rsa_key(sock, [sock, my_sign_keys,
-                               handler](boost::system::error_code ec,
-                                        CryptoPP::RSA::PublicKey sender_id,
-                                        CryptoPP::RSA::PublicKey rsa_key) {
-    if (!ec) {
-      send_crypted_signed_salsa_key(
-          sock, my_sign_keys.first, my_sign_keys.second, rsa_key,
-          [sock, handler, sender_id](boost::system::error_code ec,
-                                     CryptoPP::SecByteBlock salsa_iv,
-                                     CryptoPP::SecByteBlock salsa_key) {
-            if (!ec) {
-              accept_salsa_crypted_data(
-                  sock, salsa_iv, salsa_key,
-                  [sock, handler, sender_id](boost::system::error_code ec,
-                                             std::shared_ptr<char[]> data,
-                                             uint64_t size) {
-                    if (!ec) {
-                      auto accepted_text_pack =
-                          messenger::deserializer::deserialize(data, size);
-                      auto res =
-                          std::get_if<messenger::network_packets::dialog_text>(
-                              &accepted_text_pack);
-                      if (res != nullptr) {
-                        if (digital_signature::compare_keys(sender_id,
-                                                            res->id)) {
-                          handler(
-                              ec,
-                              std::variant<network_packets::dialog_text>(*res));
-                        } else {
-                          handler(ec,
-                                  std::variant<network_packets::dialog_text>());
-                        }
-                      }
-                    } else {
-                      handler(ec, std::variant<network_packets::dialog_text>());
-                    }
-                  });
-            } else {
-              handler(ec, std::variant<network_packets::dialog_text>());
-            }
-          });
-    } else {
-      handler(ec, std::variant<network_packets::dialog_text>());
+void accept_session_dialog_msg(std::shared_ptr<char[]> frame,
+                               uint64_t frame_len, session_cache &sessions,
+                               functor handler) {
+  messenger::reader data_reader(frame.get(), frame_len);
+  char msg_type = 0;
+  std::string session_id(session_cache::session_id_len, '\0');
+  uint64_t seq = 0;
+  uint64_t cipher_size = 0;
+  data_reader.read_sequentially(&msg_type, sizeof(msg_type));
+  data_reader.read_sequentially(session_id.data(), session_id.size());
+  data_reader.read_sequentially((char *)(&seq), sizeof(seq));
+  bool res =
+      data_reader.read_sequentially((char *)(&cipher_size), sizeof(cipher_size));
+  if (!res || cipher_size !=
+                  uint64_t(data_reader.get_limit() - data_reader.get_pointer())) {
+    handler(
+        boost::system::errc::make_error_code(boost::system::errc::bad_message),
+        std::optional<received_text>());
+    return;
+  }
+
+  auto ticket = sessions.check(session_id, seq);
+  if (!ticket) {
+    // not_found tells the caller to reject the session, replays are dropped
+    handler(sessions.has_inbound(session_id)
+                ? boost::system::errc::make_error_code(
+                      boost::system::errc::bad_message)
+                : boost::system::error_code(boost::asio::error::not_found),
+            std::optional<received_text>());
+    return;
+  }
+  auto iv = session_cache::message_iv(ticket->iv, seq);
+  CryptoPP::Salsa20::Decryption dec;
+  dec.SetKeyWithIV(ticket->key, ticket->key.size(), iv, iv.size());
+  std::shared_ptr<char[]> data(new char[cipher_size]);
+  dec.ProcessData((unsigned char *)data.get(),
+                  (const unsigned char *)data_reader.get_pointer(), cipher_size);
+
+  // the session id is cleartext, so a forged frame decrypts to garbage and
+  // must not advance the replay window
+  std::optional<received_text> text;
+  try {
+    auto accepted_text_pack =
+        messenger::deserializer::deserialize(data, cipher_size);
+    auto text_pack = std::get_if<messenger::network_packets::dialog_text>(
+        &accepted_text_pack);
+    if (text_pack != nullptr &&
+        digital_signature::compare_keys(ticket->peer, text_pack->id)) {
+      text = received_text{std::move(*text_pack), ticket->peer};
     }
-  });
+  } catch (const std::exception &) {
+  }
+  if (text && sessions.commit(session_id, seq)) {
+    handler(boost::system::errc::make_error_code(boost::system::errc::success),
+            std::move(text));
+  } else {
+    handler(
+        boost::system::errc::make_error_code(boost::system::errc::bad_message),
+        std::optional<received_text>());
+  }
+}
+
+// answers a dialog_session_text frame whose session is unknown with
+// [session id][seq] on the same connection, the sender resends the texts
+// from seq on after a new handshake. handler(ec) runs once it is written.
+template <typename functor>
+void reject_session(std::shared_ptr<boost::asio::ip::tcp::socket> sock,
+                    const char *frame, uint64_t frame_len, functor handler) {
+  uint64_t body_len = session_cache::session_id_len + sizeof(uint64_t);
+  uint64_t total_len = sizeof(uint64_t) + 1 + body_len;
+  if (frame_len < 1 + body_len) {
+    handler(
+        boost::system::errc::make_error_code(boost::system::errc::bad_message));
+    return;
+  }
+  uint64_t reply_len = total_len - sizeof(reply_len);
+  char msg_type = messenger::network_type::dialog_session_reject;
+  std::shared_ptr<char[]> data(new char[total_len]);
+  messenger::writer data_writer(data.get(), total_len);
+  data_writer.writer_sequentially((char *)(&reply_len), sizeof(reply_len));
+  data_writer.writer_sequentially(&msg_type, sizeof(msg_type));
+  data_writer.writer_sequentially(frame + 1, body_len);
+  boost::asio::async_write(
+      *sock, boost::asio::buffer(data.get(), total_len),
+      [sock, data, handler](const boost::system::error_code &ec, uint64_t) {
+        handler(ec);
+      });
 }
 
 } // namespace network
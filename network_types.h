@@ -6,11 +6,23 @@
 
 namespace messenger {
 const int IDLEN = 513;
+
+// first byte of a packet in the compact format, the network_type follows.
+// Packets starting with a network_type are in the legacy fixed IDLEN format.
+const char protocol_compact = static_cast<char>(0xC2);
+enum class wire_format { legacy = 1, compact = 2 };
+
 enum network_type {
   dialog_text = 0,
   paxos_notif = 1,
   paxos_push = 2,
-  chat_sync = 3
+  chat_sync = 3,
+  dialog_session_text = 4,
+  chat_history_chunk = 5,
+  merkle_node = 6,
+  paxos_commit = 7,
+  dialog_session_reject = 8, // written back on the sender's connection
+  network_type_count
 };
 
 namespace network_packets {
@@ -20,23 +32,65 @@ struct dialog_text {
   std::string text;
 };
 
+// promise for paxos slot seq, hash is the history hash after the slot.
+// The legacy layout has no seq, old peers run one round at a time, so their
+// promises decode as legacy_seq and count for the oldest slot in flight.
 struct paxos_notif_packet {
-  char chat_id[IDLEN] = "";
-  char id[IDLEN] = "";
-  char hash[IDLEN] = "";
+  static constexpr uint64_t legacy_seq = UINT64_MAX;
+
+  std::string chat_id;
+  std::string id;
+  std::string hash;
+  uint64_t seq = 0;
+};
+
+// sent by the proposer once slot seq reached a quorum with hash. Compact
+// only.
+struct paxos_commit_packet {
+  std::string chat_id;
+  std::string id;
+  uint64_t seq = 0;
+  std::string hash;
 };
 
+// batch of events proposed for one paxos slot
 struct paxos_push_packet {
-  char chat_id[IDLEN] = "";
-  char id[IDLEN] = "";
+  std::string chat_id;
+  std::string id;
   uint64_t time = 0;
-  std::shared_ptr<messenger::chat_event> c_event;
+  std::vector<std::shared_ptr<messenger::chat_event>> events;
 };
 
+// history_len and history_hash describe the requester's current history, the
+// responder sends only the events after it when its own prefix matches
 struct request_chat_hash {
-  char chat_id[IDLEN] = "";
-  char id[IDLEN] = "";
+  std::string chat_id;
+  std::string id;
   uint64_t time = 0;
+  uint64_t history_len = 0;
+  std::string history_hash;
+};
+
+// consecutive history events starting at first_index, about
+// history_chunk_size bytes per frame; the last chunk of a sync has last set
+struct chat_history_chunk {
+  std::string chat_id;
+  uint64_t first_index = 0;
+  bool last = false;
+  std::vector<std::shared_ptr<messenger::chat_event>> events;
+};
+
+const uint64_t history_chunk_size = 64 * 1024;
+
+// digest of merkle tree node (level, index) of a chat history. Sent with an
+// empty digest as a query, the reply carries the node digest (empty if the
+// node is not complete yet) and the responder's leaf count. Compact only.
+struct merkle_node {
+  std::string chat_id;
+  uint32_t level = 0;
+  uint64_t index = 0;
+  uint64_t leaf_count = 0;
+  std::string digest;
 };
 
 } // namespace network_packets
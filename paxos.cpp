@@ -1,62 +1,251 @@
 #include "paxos.h"
+#include "network_types.h"
+#include <algorithm>
 namespace messenger {
-paxos::paxos(boost::asio::io_context &io, chat &c,
-             std::vector<std::pair<std::string, uint32_t>> &participants_vec)
-    : c_chat(c), timer(io) {
+paxos::paxos(boost::asio::io_context &io_c, chat &c,
+             std::vector<std::pair<std::string, uint32_t>> &participants_vec,
+             paxos_settings s)
+    : settings(s), c_chat(c), strand(c.get_strand()), io(io_c),
+      batch_timer(io_c) {
+  settings.pipeline_depth = std::max(settings.pipeline_depth, uint32_t(1));
+  settings.batch_cap = std::max(settings.batch_cap, uint32_t(1));
   for (auto &i : participants_vec) {
-    participants[i.first] = i.second;
-  }
-  for (auto &i : participants) {
+    auto id = id_interner::global().intern(i.first);
+    auto number = participant_number.find(id);
+    if (number != nullptr) {
+      total_weight -= participants[*number].weight;
+      participants[*number].weight = i.second;
+    } else {
+      participant_number[id] = participants.size();
+      participants.push_back({id, i.second});
+    }
     total_weight += i.second;
   }
 }
 
-uint32_t paxos::start_accept(std::shared_ptr<messenger::chat_event> msg,
-                             uint64_t deadline) {
-  std::unique_lock ul{paxos_locker};
-  timer.expires_after(std::chrono::milliseconds(deadline));
-  timer.async_wait([this](const boost::system::error_code &ec) {
-    if (!ec) {
-      this->stop();
-    }
-  });
-  if (state == paxos_states::free) {
-    state = paxos_states::busy;
-    c_value = msg;
-    return 0;
-  }
-  return 1;
-}
-
-void paxos::accept_promise(std::string id, std::string hash) {
-  std::unique_lock ul{paxos_locker};
-  if (state == paxos_states::busy) {
-    if (registered_members[id] == false) {
-      registered_members[id] = true;
-      data_version_weights[hash] += participants[id];
-      if (data_version_weights[hash] >
-          data_version_weights[most_common_value]) {
-        most_common_value = hash;
-      }
-      if (2 * data_version_weights[most_common_value] > total_weight) {
-        if (most_common_value == c_chat.new_hash(c_value)) {
-          handler(paxos_errors::ok);
-        } else {
-          handler(paxos_errors::hash_mismatch);
+paxos_states paxos::get_state() {
+  return slots.empty() ? paxos_states::free : paxos_states::busy;
+}
+
+paxos_settings paxos::get_settings() {
+  return settings;
+}
+
+void paxos::set_settings(paxos_settings s) {
+  settings = s;
+  settings.pipeline_depth = std::max(settings.pipeline_depth, uint32_t(1));
+  settings.batch_cap = std::max(settings.batch_cap, uint32_t(1));
+}
+
+std::optional<paxos::ticket>
+paxos::start_accept(std::vector<std::shared_ptr<messenger::chat_event>> msgs,
+                    std::vector<commit_handler> waiters) {
+  if (msgs.empty() || slots.size() >= settings.pipeline_depth) {
+    return std::nullopt;
+  }
+  auto [seq, prev] = next_slot(msgs);
+  auto &s = slots[seq];
+  s.c_values = std::move(msgs);
+  s.expected = prev;
+  s.waiters = std::move(waiters);
+  s.round = ++rounds;
+  s.registered_members.assign(participants.size(), false);
+  s.opened = std::chrono::steady_clock::now();
+  metrics.rounds++;
+  auto deadline = round_deadline();
+  s.timer = std::make_shared<boost::asio::steady_timer>(io, deadline);
+  s.timer->async_wait(boost::asio::bind_executor(
+      strand, [this, seq, round = s.round,
+               deadline](const boost::system::error_code &ec) {
+        if (ec) {
+          return;
+        }
+        auto it = slots.find(seq);
+        if (it != slots.end() && it->second.round == round) {
+          // silent peers took at least the deadline
+          for (uint32_t i = 0; i < participants.size(); i++) {
+            if (!it->second.registered_members[i]) {
+              promise_latency.add(i, deadline.count());
+            }
+          }
+          handler(seq, paxos_errors::timed_out);
         }
+      }));
+  ticket res{seq, chat::to_hex(s.expected)};
+
+  early_promises.erase(early_promises.begin(),
+                       early_promises.lower_bound(seq));
+  auto early = early_promises.find(seq);
+  if (early != early_promises.end()) {
+    auto promises = std::move(early->second);
+    early_promises.erase(early);
+    for (auto &i : promises) {
+      if (slots.find(seq) == slots.end()) {
+        break;
       }
+      count_promise(seq, slots[seq], i.first, i.second, false);
+    }
+  }
+  return res;
+}
+
+std::pair<uint64_t, chat_digest> paxos::next_slot(
+    const std::vector<std::shared_ptr<messenger::chat_event>> &msgs) {
+  uint64_t seq = 0;
+  chat_digest prev;
+  if (slots.empty()) {
+    seq = c_chat.size();
+    prev = c_chat.digest();
+  } else {
+    seq = slots.rbegin()->first + slots.rbegin()->second.c_values.size();
+    prev = slots.rbegin()->second.expected;
+  }
+  for (auto &i : msgs) {
+    prev = chat::chain(prev, *i);
+  }
+  return {seq, prev};
+}
+
+std::string paxos::next_hash(
+    const std::vector<std::shared_ptr<messenger::chat_event>> &msgs) {
+  return chat::to_hex(next_slot(msgs).second);
+}
+
+void paxos::accept_promise(id_handle id, uint64_t seq, std::string hash) {
+  auto number = participant_number.find(id);
+  if (number == nullptr) {
+    return;
+  }
+  if (seq == network_packets::paxos_notif_packet::legacy_seq) {
+    if (slots.empty()) {
+      return;
+    }
+    seq = slots.begin()->first;
+  }
+  auto it = slots.find(seq);
+  if (it != slots.end()) {
+    count_promise(seq, it->second, *number, hash);
+    return;
+  }
+  // a slot the other replicas opened first, kept within the pipeline window
+  uint64_t next = slots.empty() ? c_chat.size()
+                                 : slots.rbegin()->first +
+                                       slots.rbegin()->second.c_values.size();
+  if (seq < next ||
+      seq >= next + uint64_t(settings.pipeline_depth) * settings.batch_cap) {
+    return;
+  }
+  if (early_promises.find(seq) == early_promises.end() &&
+      early_promises.size() >= settings.pipeline_depth) {
+    // the nearest slots open first, bogus far ones make room for them
+    if (seq > early_promises.rbegin()->first) {
+      return;
+    }
+    early_promises.erase(std::prev(early_promises.end()));
+  }
+  early_promises[seq].insert_or_assign(*number, std::move(hash));
+}
+
+void paxos::count_promise(uint64_t seq, slot &s, uint32_t member,
+                          const std::string &hash, bool timed) {
+  if (s.accepted || s.registered_members[member]) {
+    return;
+  }
+  s.registered_members[member] = true;
+  if (timed) {
+    promise_latency.add(
+        member, std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::steady_clock::now() - s.opened)
+                    .count());
+  }
+  auto version = std::find_if(
+      s.data_version_weights.begin(), s.data_version_weights.end(),
+      [&hash](const auto &i) { return i.first == hash; });
+  if (version == s.data_version_weights.end()) {
+    version = s.data_version_weights.insert(version, {hash, 0});
+  }
+  version->second += participants[member].weight;
+  if (version->second > s.most_common_weight) {
+    s.most_common_weight = version->second;
+    s.most_common_value = hash;
+  }
+  if (2 * s.most_common_weight > total_weight) {
+    if (s.most_common_value == chat::to_hex(s.expected)) {
+      handler(seq, paxos_errors::ok);
+    } else {
+      handler(seq, paxos_errors::hash_mismatch);
     }
   }
 }
 
+bool paxos::accept_commit(id_handle id, uint64_t seq, std::string hash) {
+  if (participant_number.find(id) == nullptr) {
+    return false;
+  }
+  auto it = slots.find(seq);
+  if (it == slots.end()) {
+    if (seq >= c_chat.size() && seq >= sync_requested) {
+      sync_requested = seq + 1;
+      return true;
+    }
+    return false;
+  }
+  if (it->second.accepted) {
+    return false;
+  }
+  if (hash == chat::to_hex(it->second.expected)) {
+    handler(seq, paxos_errors::ok);
+  } else {
+    handler(seq, paxos_errors::hash_mismatch);
+  }
+  return false;
+}
+
 void paxos::stop() {
-  std::unique_lock ul{paxos_locker};
-  handler(paxos_errors::force_stop);
+  auto waiting = std::move(deferred);
+  deferred.clear();
+  for (auto &b : waiting) {
+    for (auto &i : b.waiters) {
+      boost::asio::post(io, [done = std::move(i)]() {
+        done(paxos_errors::force_stop, 0);
+      });
+    }
+  }
+  if (!slots.empty()) {
+    handler(slots.begin()->first, paxos_errors::force_stop);
+  }
+}
+
+void paxos::submit(std::vector<std::shared_ptr<messenger::chat_event>> batch,
+                   std::vector<commit_handler> waiters,
+                   propose_function propose) {
+  // behind earlier deferred batches, so events keep their order
+  if (!deferred.empty() || slots.size() >= settings.pipeline_depth) {
+    deferred.push_back({std::move(batch), std::move(waiters),
+                        std::move(propose)});
+    return;
+  }
+  propose(std::move(batch), std::move(waiters));
+}
+
+void paxos::release_deferred() {
+  if (release_posted || deferred.empty()) {
+    return;
+  }
+  release_posted = true;
+  boost::asio::post(strand, [this]() {
+    release_posted = false;
+    while (!deferred.empty() && slots.size() < settings.pipeline_depth) {
+      auto b = std::move(deferred.front());
+      deferred.pop_front();
+      b.propose(std::move(b.events), std::move(b.waiters));
+    }
+  });
 }
 
 bool paxos::correct_action(std::shared_ptr<messenger::chat_event> msg) {
-  std::unique_lock ul{paxos_locker};
-  if (participants.find(msg->initiator) != participants.end()) {
+  auto id = id_interner::global().find(msg->initiator);
+  if (id && participant_number.find(*id) != nullptr) {
     if (msg->event_type == messenger::chat_event_types::chat_text_type) {
       return true;
     }
@@ -64,27 +253,85 @@ bool paxos::correct_action(std::shared_ptr<messenger::chat_event> msg) {
   return false;
 }
 
-void paxos::handler(uint32_t ec) {
+void paxos::handler(uint64_t seq, uint32_t ec) {
   if (ec == paxos_errors::ok) {
-    if (c_value->event_type == messenger::chat_new_user_type) {
-      auto s = std::dynamic_pointer_cast<messenger::chat_new_user>(c_value);
-    }
-    c_chat.add(std::move(c_value));
-  } else if (ec == paxos_errors::force_stop) {
+    slots[seq].accepted = true;
+    commit_ready();
+    return;
+  }
+  if (ec == paxos_errors::force_stop) {
     std::cout << "paxos was stoped" << std::endl;
+  } else if (ec == paxos_errors::timed_out) {
+    metrics.timeouts++;
+    std::cout << "paxos round timed out" << std::endl;
   } else if (ec == paxos_errors::hash_mismatch) {
+    metrics.mismatches++;
     std::cout << "hash mismatch. Cant push msg" << std::endl;
   }
-  clear();
+  // later slots were chained on this one
+  for (auto it = slots.lower_bound(seq); it != slots.end(); ++it) {
+    notify(it->second, it->first, ec);
+  }
+  clear(seq);
+  release_deferred();
+}
+
+void paxos::notify(slot &s, uint64_t seq, uint32_t ec) {
+  for (auto &i : s.waiters) {
+    boost::asio::post(io, [done = std::move(i), ec, seq]() { done(ec, seq); });
+  }
+  s.waiters.clear();
+}
+
+// adds accepted slots to the chat as long as there is no gap before them
+void paxos::commit_ready() {
+  while (!slots.empty() && slots.begin()->second.accepted) {
+    auto &s = slots.begin()->second;
+    s.timer->cancel();
+    uint64_t duration = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::steady_clock::now() - s.opened)
+                            .count();
+    round_times.add(duration);
+    metrics.commits++;
+    metrics.round_ms_total += duration;
+    c_chat.add(std::move(s.c_values));
+    notify(s, slots.begin()->first, paxos_errors::ok);
+    slots.erase(slots.begin());
+  }
+  release_deferred();
 }
 
-void paxos::clear() {
-  state = paxos_states::free;
-  c_value = std::shared_ptr<messenger::chat_event>(nullptr);
-  registered_members.clear();
-  data_version_weights.clear();
-  most_common_value.clear();
-  timer.cancel();
+// time by which a quorum answered in timeout_percentile of recent rounds
+std::chrono::milliseconds paxos::round_deadline() {
+  std::vector<std::pair<uint64_t, uint32_t>> latencies; // ms, weight
+  for (uint32_t i = 0; i < participants.size(); i++) {
+    auto ms = promise_latency.percentile(i, settings.timeout_percentile);
+    latencies.emplace_back(ms ? *ms : settings.initial_timeout.count(),
+                           participants[i].weight);
+  }
+  std::sort(latencies.begin(), latencies.end());
+  uint64_t quorum = settings.initial_timeout.count();
+  uint32_t weight = 0;
+  for (auto &i : latencies) {
+    weight += i.second;
+    if (2 * weight > total_weight) {
+      quorum = i.first;
+      break;
+    }
+  }
+  return std::clamp(std::chrono::milliseconds(quorum) + settings.timeout_margin,
+                    settings.min_timeout, settings.max_timeout);
+}
+
+std::optional<uint64_t> paxos::round_duration(double p) {
+  return round_times.percentile(p);
+}
+
+void paxos::clear(uint64_t from) {
+  for (auto it = slots.lower_bound(from); it != slots.end();) {
+    it->second.timer->cancel();
+    it = slots.erase(it);
+  }
 }
 
-} // namespace messenger
\ No newline at end of file
+} // namespace messenger
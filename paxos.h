@@ -2,31 +2,165 @@
 #define PAXOS_H
 
 #include "chat.h"
+#include "id_interner.h"
+#include "latency_tracker.h"
 //#include "tcpserver.h"
 #include "boost/asio.hpp"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <optional>
 #include <set>
 #include <string>
+#include <vector>
 
 namespace messenger {
 enum paxos_states { free = 0, busy = 1 };
-enum paxos_errors { ok = 0, paxos_busy = 1, hash_mismatch = 2, force_stop = 3 };
+enum paxos_errors {
+  ok = 0,
+  paxos_busy = 1,
+  hash_mismatch = 2,
+  force_stop = 3,
+  timed_out = 4
+};
+
+struct paxos_settings {
+  uint32_t pipeline_depth = 16;
+  // a batch is proposed batch_window after its first event or at batch_cap
+  std::chrono::milliseconds batch_window{20};
+  uint32_t batch_cap = 64;
+  // a round times out after the timeout_percentile promise latency of the
+  // quorum plus timeout_margin, initial_timeout stands in for unseen peers
+  double timeout_percentile = 0.95;
+  std::chrono::milliseconds timeout_margin{50};
+  std::chrono::milliseconds initial_timeout{1000};
+  std::chrono::milliseconds min_timeout{50};
+  std::chrono::milliseconds max_timeout{5000};
+};
+
+struct paxos_metrics {
+  std::atomic<uint64_t> rounds{0};
+  std::atomic<uint64_t> commits{0};
+  std::atomic<uint64_t> timeouts{0};
+  std::atomic<uint64_t> mismatches{0};
+  std::atomic<uint64_t> round_ms_total{0}; // over committed rounds
+};
 
+// Rounds run in slots numbered by the history index of their first event.
+// Each slot holds a batch of events, up to pipeline_depth slots are in
+// flight, each expects the hash chained from the slot before it, and
+// accepted slots are added to the chat in order.
+// Runs on the chat's strand: members other than loop_through_users,
+// correct_action and the metrics must be called there.
 class paxos {
 public:
   paxos(boost::asio::io_context &, chat &,
-        std::vector<std::pair<std::string, uint32_t>> &);
+        std::vector<std::pair<std::string, uint32_t>> &,
+        paxos_settings s = paxos_settings());
+
+  // free when no slot is in flight
+  paxos_states get_state();
+
+  paxos_settings get_settings();
+  void set_settings(paxos_settings s);
+
+  struct ticket {
+    uint64_t seq;
+    std::string hash; // history hash promises for this slot must carry
+  };
 
-  paxos_states get_state() { return state; }
+  // called once per proposal with a paxos_errors code and the slot seq,
+  // posted to the io_context after the batch was added to the chat or the
+  // slot failed
+  using commit_handler = std::function<void(uint32_t, uint64_t)>;
 
-  uint32_t start_accept(std::shared_ptr<messenger::chat_event>, uint64_t);
+  // opens the next slot for the batch, nullopt if the pipeline is full.
+  // Promises that arrived early are counted inside, so waiters may already
+  // be notified when it returns.
+  std::optional<ticket>
+  start_accept(std::vector<std::shared_ptr<messenger::chat_event>>,
+               std::vector<commit_handler> waiters = {});
 
-  void accept_promise(std::string id, std::string hash);
+  // hash start_accept would give the slot for msgs
+  std::string
+  next_hash(const std::vector<std::shared_ptr<messenger::chat_event>> &msgs);
 
+  const paxos_metrics &get_metrics() const { return metrics; }
+
+  // p-th percentile of recent committed round durations in milliseconds
+  std::optional<uint64_t> round_duration(double p);
+
+  double timeout_rate() {
+    uint64_t started = metrics.rounds;
+    return started == 0 ? 0.0 : double(metrics.timeouts) / started;
+  }
+
+  using propose_function =
+      std::function<void(std::vector<std::shared_ptr<messenger::chat_event>>,
+                         std::vector<commit_handler>)>;
+
+  // queues a local event, functor(std::vector<std::shared_ptr<chat_event>>,
+  // std::vector<commit_handler>) is called with each batch to propose. While
+  // every pipeline slot is busy batches wait in order and are proposed as
+  // slots free up.
+  template <typename functor>
+  void propose_event(std::shared_ptr<messenger::chat_event> c_event,
+                     commit_handler done, functor propose) {
+    pending.push_back(std::move(c_event));
+    if (done) {
+      pending_waiters.push_back(std::move(done));
+    }
+    if (pending.size() >= settings.batch_cap) {
+      batch_timer.cancel();
+      auto batch = std::move(pending);
+      auto waiters = std::move(pending_waiters);
+      pending.clear();
+      pending_waiters.clear();
+      submit(std::move(batch), std::move(waiters), propose);
+      return;
+    }
+    if (pending.size() == 1) {
+      batch_timer.expires_after(settings.batch_window);
+      batch_timer.async_wait(boost::asio::bind_executor(
+          strand, [this, propose](const boost::system::error_code &ec) {
+            if (ec) {
+              return;
+            }
+            auto batch = std::move(pending);
+            auto waiters = std::move(pending_waiters);
+            pending.clear();
+            pending_waiters.clear();
+            if (!batch.empty()) {
+              submit(std::move(batch), std::move(waiters), propose);
+            }
+          }));
+    }
+  }
+
+  // seq is paxos_notif_packet::legacy_seq for promises of old peers
+  void accept_promise(id_handle id, uint64_t seq, std::string hash);
+
+  // a replica saw a quorum for slot seq, applies it without waiting for
+  // the remaining promises. True if the slot is not open here and lies past
+  // the history, e.g. it timed out locally, so this replica has to sync.
+  // Reported once per missed seq.
+  bool accept_commit(id_handle id, uint64_t seq, std::string hash);
+
+  // fails every slot in flight
   void stop();
 
+  chat::strand_type &get_strand() { return strand; }
+
+  struct participant {
+    id_handle id;
+    uint32_t weight;
+  };
+
+  // processor(const participant &)
   template <typename T> void loop_through_users(T processor) {
     for (auto &i : participants) {
       processor(i);
@@ -36,20 +170,72 @@ public:
   bool correct_action(std::shared_ptr<messenger::chat_event>);
 
 private:
-  void handler(uint32_t);
+  struct slot {
+    std::vector<std::shared_ptr<messenger::chat_event>> c_values;
+    chat_digest expected;
+    uint64_t round = 0;
+    std::chrono::steady_clock::time_point opened;
+    bool accepted = false;
+    std::vector<bool> registered_members; // by participant number
+    // hash, weight. Replicas rarely disagree, so this stays tiny
+    std::vector<std::pair<std::string, uint32_t>> data_version_weights;
+    uint32_t most_common_weight = 0;
+    std::string most_common_value = "";
+    std::shared_ptr<boost::asio::steady_timer> timer;
+    std::vector<commit_handler> waiters;
+  };
+
+  void notify(slot &s, uint64_t seq, uint32_t ec);
+
+  struct deferred_batch {
+    std::vector<std::shared_ptr<messenger::chat_event>> events;
+    std::vector<commit_handler> waiters;
+    propose_function propose;
+  };
+
+  void submit(std::vector<std::shared_ptr<messenger::chat_event>> batch,
+              std::vector<commit_handler> waiters, propose_function propose);
+
+  // proposes deferred batches while slots are free, posted to the strand
+  void release_deferred();
+
+  // seq and expected digest of the slot after the last one in flight
+  std::pair<uint64_t, chat_digest>
+  next_slot(const std::vector<std::shared_ptr<messenger::chat_event>> &msgs);
+
+  void count_promise(uint64_t seq, slot &s, uint32_t member,
+                     const std::string &hash, bool timed = true);
+
+  std::chrono::milliseconds round_deadline();
+
+  void handler(uint64_t seq, uint32_t);
+
+  void commit_ready();
 
-  void clear();
+  void clear(uint64_t from);
 
-  std::map<std::string, uint32_t> participants; // id, weight
-  std::map<std::string, bool> registered_members;
-  std::map<std::string, uint32_t> data_version_weights;
-  std::string most_common_value = "";
+  std::vector<participant> participants;
+  handle_map<uint32_t> participant_number; // id, index in participants
   uint32_t total_weight = 0;
-  std::shared_ptr<messenger::chat_event> c_value;
-  paxos_states state = paxos_states::free;
+  paxos_settings settings;
+  std::map<uint64_t, slot> slots; // seq, in flight
+  std::vector<std::shared_ptr<messenger::chat_event>> pending;
+  std::vector<commit_handler> pending_waiters;
+  std::deque<deferred_batch> deferred; // waiting for a free slot
+  uint64_t sync_requested = 0; // missed commits below it asked for a sync
+  bool release_posted = false;
+  // promises that arrived before their slot was opened here, at most one
+  // per participant and pipeline_depth slots ahead
+  std::map<uint64_t, std::map<uint32_t, std::string>>
+      early_promises; // seq, participant number, hash
+  uint64_t rounds = 0;
+  latency_tracker promise_latency; // by participant number
+  latency_window round_times;
+  paxos_metrics metrics;
   chat &c_chat;
-  std::mutex paxos_locker;
-  boost::asio::steady_timer timer;
+  chat::strand_type strand;
+  boost::asio::io_context &io;
+  boost::asio::steady_timer batch_timer;
 };
 } // namespace messenger
 #endif
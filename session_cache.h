@@ -0,0 +1,253 @@
+#ifndef SESSION_CACHE_H
+#define SESSION_CACHE_H
+
+#include "crypto_utils.h"
+#include <chrono>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace messenger {
+namespace network {
+
+// Salsa20 sessions established by the signed RSA handshake. The sender keys
+// them by the recipient's sign-key fingerprint, the receiver by session id.
+// Every message uses its own iv (base iv xor sequence number), the handshake
+// message itself is sequence 0. A receiver that does not know a session
+// rejects it, the sender then drops the session and resends its recent texts
+// through a new handshake.
+class session_cache {
+public:
+  static constexpr uint64_t session_id_len = 16;
+  static constexpr uint64_t replay_window = 64;
+  static constexpr uint64_t resend_window = 16; // texts kept per session
+
+  struct outbound_ticket {
+    std::string session_id;
+    uint64_t seq = 0;
+    CryptoPP::SecByteBlock iv;
+    CryptoPP::SecByteBlock key;
+  };
+
+  struct inbound_ticket {
+    CryptoPP::SecByteBlock iv;
+    CryptoPP::SecByteBlock key;
+    digital_signature::key_fingerprint peer;
+  };
+
+  // outbound session the receiver did not know, texts from the rejected
+  // sequence number on
+  struct rejected_session {
+    digital_signature::key_fingerprint peer;
+    std::string peer_id;
+    std::vector<std::string> texts;
+  };
+
+  session_cache(std::chrono::seconds age = std::chrono::minutes(10),
+                uint64_t messages = 1 << 20)
+      : max_age(age), max_messages(messages) {}
+
+  static digital_signature::key_fingerprint
+  fingerprint(const CryptoPP::RSA::PublicKey &key) {
+    return digital_signature::fingerprint(key);
+  }
+
+  static std::string session_id(const CryptoPP::SecByteBlock &iv,
+                                const CryptoPP::SecByteBlock &key) {
+    CryptoPP::SHA256 sha;
+    CryptoPP::byte digest[CryptoPP::SHA256::DIGESTSIZE];
+    sha.Update(iv.data(), iv.size());
+    sha.Update(key.data(), key.size());
+    sha.Final(digest);
+    return std::string((const char *)digest, session_id_len);
+  }
+
+  static CryptoPP::SecByteBlock message_iv(const CryptoPP::SecByteBlock &iv,
+                                           uint64_t seq) {
+    CryptoPP::SecByteBlock res(iv.data(), iv.size());
+    for (uint64_t i = 0; i < sizeof(seq) && i < res.size(); i++) {
+      res[i] ^= static_cast<CryptoPP::byte>(seq >> (8 * i));
+    }
+    return res;
+  }
+
+  // next sequence number of a live session, nullopt if a handshake is needed.
+  // text is kept for a resend if the session gets rejected.
+  std::optional<outbound_ticket>
+  acquire(const digital_signature::key_fingerprint &fingerprint,
+          const std::string &text) {
+    std::unique_lock ul{locker};
+    auto it = outbound.find(fingerprint);
+    if (it == outbound.end()) {
+      return std::nullopt;
+    }
+    if (expired(it->second.created) || it->second.next_seq > max_messages) {
+      outbound.erase(it);
+      return std::nullopt;
+    }
+    auto &s = it->second;
+    if (s.recent.size() == resend_window) {
+      s.recent.pop_front();
+    }
+    s.recent.emplace_back(s.next_seq, text);
+    return outbound_ticket{s.id, s.next_seq++, s.iv, s.key};
+  }
+
+  void store_outbound(const digital_signature::key_fingerprint &fingerprint,
+                      const std::string &peer_id,
+                      const CryptoPP::SecByteBlock &iv,
+                      const CryptoPP::SecByteBlock &key) {
+    std::unique_lock ul{locker};
+    outbound_session s;
+    s.id = session_id(iv, key);
+    s.peer_id = peer_id;
+    s.iv = iv;
+    s.key = key;
+    s.created = std::chrono::steady_clock::now();
+    outbound[fingerprint] = std::move(s);
+  }
+
+  void invalidate(const digital_signature::key_fingerprint &fingerprint) {
+    std::unique_lock ul{locker};
+    outbound.erase(fingerprint);
+  }
+
+  // drops the outbound session id, nullopt if it is already gone
+  std::optional<rejected_session> reject(const std::string &id,
+                                         uint64_t seq) {
+    std::unique_lock ul{locker};
+    for (auto it = outbound.begin(); it != outbound.end(); ++it) {
+      if (it->second.id != id) {
+        continue;
+      }
+      rejected_session res;
+      res.peer = it->first;
+      res.peer_id = std::move(it->second.peer_id);
+      for (auto &i : it->second.recent) {
+        if (i.first >= seq) {
+          res.texts.push_back(std::move(i.second));
+        }
+      }
+      outbound.erase(it);
+      return res;
+    }
+    return std::nullopt;
+  }
+
+  void store_inbound(const CryptoPP::SecByteBlock &iv,
+                     const CryptoPP::SecByteBlock &key,
+                     const digital_signature::key_fingerprint &peer) {
+    std::unique_lock ul{locker};
+    purge_inbound();
+    inbound_session s;
+    s.iv = iv;
+    s.key = key;
+    s.peer = peer;
+    s.created = std::chrono::steady_clock::now();
+    inbound[session_id(iv, key)] = std::move(s);
+  }
+
+  // false once the session expired or if it never existed, e.g. before a
+  // restart
+  bool has_inbound(const std::string &id) {
+    std::unique_lock ul{locker};
+    auto it = inbound.find(id);
+    return it != inbound.end() && !expired(it->second.created);
+  }
+
+  // key of a live session if seq is inside its replay window and unused.
+  // Nothing is marked, the frame must be authenticated before commit.
+  std::optional<inbound_ticket> check(const std::string &id, uint64_t seq) {
+    std::unique_lock ul{locker};
+    auto it = inbound.find(id);
+    if (it == inbound.end() || seq == 0 || seq > max_messages) {
+      return std::nullopt;
+    }
+    auto &s = it->second;
+    if (expired(s.created)) {
+      inbound.erase(it);
+      return std::nullopt;
+    }
+    if (!fresh(s, seq)) {
+      return std::nullopt;
+    }
+    return inbound_ticket{s.iv, s.key, s.peer};
+  }
+
+  // marks seq as used once its frame decrypted to a text from the peer,
+  // false if another copy got there first
+  bool commit(const std::string &id, uint64_t seq) {
+    std::unique_lock ul{locker};
+    auto it = inbound.find(id);
+    if (it == inbound.end() || !fresh(it->second, seq)) {
+      return false;
+    }
+    auto &s = it->second;
+    if (seq > s.last_seq) {
+      uint64_t shift = seq - s.last_seq;
+      s.seen = shift >= replay_window ? 0 : s.seen << shift;
+      s.seen |= 1;
+      s.last_seq = seq;
+    } else {
+      s.seen |= uint64_t(1) << (s.last_seq - seq);
+    }
+    return true;
+  }
+
+private:
+  struct outbound_session {
+    std::string id;
+    std::string peer_id;
+    std::deque<std::pair<uint64_t, std::string>> recent;
+    CryptoPP::SecByteBlock iv;
+    CryptoPP::SecByteBlock key;
+    uint64_t next_seq = 1;
+    std::chrono::steady_clock::time_point created;
+  };
+
+  struct inbound_session {
+    CryptoPP::SecByteBlock iv;
+    CryptoPP::SecByteBlock key;
+    digital_signature::key_fingerprint peer;
+    uint64_t last_seq = 0;
+    uint64_t seen = 1; // bit i - last_seq - i was accepted
+    std::chrono::steady_clock::time_point created;
+  };
+
+  static bool fresh(const inbound_session &s, uint64_t seq) {
+    if (seq > s.last_seq) {
+      return true;
+    }
+    uint64_t offset = s.last_seq - seq;
+    return offset < replay_window && !((s.seen >> offset) & 1);
+  }
+
+  bool expired(std::chrono::steady_clock::time_point created) {
+    return std::chrono::steady_clock::now() - created > max_age;
+  }
+
+  void purge_inbound() {
+    for (auto it = inbound.begin(); it != inbound.end();) {
+      if (expired(it->second.created)) {
+        it = inbound.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  std::chrono::seconds max_age;
+  uint64_t max_messages;
+  std::map<digital_signature::key_fingerprint, outbound_session> outbound;
+  std::map<std::string, inbound_session> inbound;
+  std::mutex locker;
+};
+
+} // namespace network
+} // namespace messenger
+
+#endif
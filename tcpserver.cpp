@@ -1,32 +1,236 @@
 #include "tcpserver.h"
 #include "network.h"
 #include "network_types.h"
+#include <array>
+
+namespace {
+using messenger::network::messenger_server;
+using frame_handler = void (*)(messenger_server *,
+                               std::shared_ptr<boost::asio::ip::tcp::socket>,
+                               std::shared_ptr<char[]>, uint64_t);
+
+void on_dialog_text(
+    messenger_server *serv, boost::system::error_code ec,
+    std::optional<messenger::network::received_text> res) {
+  if (!ec && res) {
+    serv->dialog_text_handler(std::move(res->text), res->sender);
+  }
+}
+
+// handshake continues on the same socket, frames resume when it is done
+void dispatch_dialog_text(messenger_server *serv,
+                          std::shared_ptr<boost::asio::ip::tcp::socket> sock,
+                          std::shared_ptr<char[]> data, uint64_t len) {
+  auto ex = sock->get_executor();
+  boost::asio::co_spawn(
+      ex,
+      messenger::network::accept_dialog_msg(
+          sock, std::move(data), len, serv->keys, serv->get_sessions(),
+          serv->get_sign_keys(), serv->get_frames(),
+          messenger_server::max_frame_len),
+      [serv, sock](std::exception_ptr e,
+                   std::optional<messenger::network::received_text> res) {
+        auto ec = messenger::network::error_from(e);
+        on_dialog_text(serv, ec, std::move(res));
+        if (!ec) {
+          serv->read_frames(sock);
+        }
+      });
+}
+
+void dispatch_dialog_session_text(
+    messenger_server *serv, std::shared_ptr<boost::asio::ip::tcp::socket> sock,
+    std::shared_ptr<char[]> data, uint64_t len) {
+  bool rejected = false;
+  messenger::network::accept_session_dialog_msg(
+      data, len, serv->get_sessions(),
+      [serv, &rejected](
+          boost::system::error_code ec,
+          std::optional<messenger::network::received_text> res) {
+        rejected = ec == boost::asio::error::not_found;
+        on_dialog_text(serv, ec, std::move(res));
+      });
+  if (!rejected) {
+    serv->read_frames(sock);
+    return;
+  }
+  // the next frame is read once the reject is written, so rejects on one
+  // connection never overlap
+  messenger::network::reject_session(
+      sock, data.get(), len, [serv, sock](boost::system::error_code ec) {
+        if (!ec) {
+          serv->read_frames(sock);
+        }
+      });
+}
+
+// the peer did not know a session we sent on: drop it and resend the texts
+// it lost, one after another so the first handshake is reused
+void resend_rejected(
+    messenger_server *serv,
+    std::shared_ptr<messenger::network::session_cache::rejected_session>
+        rejected,
+    uint64_t i) {
+  if (i == rejected->texts.size()) {
+    return;
+  }
+  messenger::network::send_dialog_msg(
+      serv, rejected->peer_id, rejected->texts[i], serv->keys.first,
+      serv->keys.second, rejected->peer,
+      [serv, rejected, i](boost::system::error_code ec) {
+        if (!ec) {
+          resend_rejected(serv, rejected, i + 1);
+        }
+      });
+}
+
+void dispatch_paxos_notif(messenger_server *serv,
+                          std::shared_ptr<boost::asio::ip::tcp::socket> sock,
+                          std::shared_ptr<char[]> data, uint64_t len) {
+  auto res = messenger::deserializer::deserialize(data, len);
+  auto pack = std::get_if<messenger::network_packets::paxos_notif_packet>(&res);
+  if (pack != nullptr) {
+    messenger::network::handle_paxos_notif(
+        serv, std::make_shared<messenger::network_packets::paxos_notif_packet>(
+                  std::move(*pack)));
+  }
+  serv->read_frames(sock);
+}
+
+void dispatch_paxos_push(messenger_server *serv,
+                         std::shared_ptr<boost::asio::ip::tcp::socket> sock,
+                         std::shared_ptr<char[]> data, uint64_t len) {
+  auto res = messenger::deserializer::deserialize(data, len);
+  auto pack = std::get_if<messenger::network_packets::paxos_push_packet>(&res);
+  if (pack != nullptr) {
+    messenger::network::handle_paxos_push(
+        serv, std::make_shared<messenger::network_packets::paxos_push_packet>(
+                  std::move(*pack)));
+  }
+  serv->read_frames(sock);
+}
+
+void dispatch_paxos_commit(messenger_server *serv,
+                           std::shared_ptr<boost::asio::ip::tcp::socket> sock,
+                           std::shared_ptr<char[]> data, uint64_t len) {
+  auto res = messenger::deserializer::deserialize(data, len);
+  auto pack =
+      std::get_if<messenger::network_packets::paxos_commit_packet>(&res);
+  if (pack != nullptr) {
+    messenger::network::handle_paxos_commit(
+        serv,
+        std::make_shared<messenger::network_packets::paxos_commit_packet>(
+            std::move(*pack)));
+  }
+  serv->read_frames(sock);
+}
+
+// history is written back on the same socket, frames resume when it is sent
+void dispatch_chat_sync(messenger_server *serv,
+                        std::shared_ptr<boost::asio::ip::tcp::socket> sock,
+                        std::shared_ptr<char[]> data, uint64_t len) {
+  auto res = messenger::deserializer::deserialize(data, len);
+  auto pack = std::get_if<messenger::network_packets::request_chat_hash>(&res);
+  auto chat_inst = pack != nullptr
+                       ? serv->get_chat_list().find(pack->chat_id)
+                       : nullptr;
+  if (chat_inst == nullptr) {
+    serv->read_frames(sock);
+    return;
+  }
+  boost::asio::co_spawn(
+      chat_inst->get_strand(),
+      messenger::network::share_chat_history(serv, chat_inst, std::move(*pack),
+                                             sock),
+      boost::asio::detached);
+}
+
+// answers a digest query on the same socket, frames resume when it is sent
+void dispatch_merkle_node(messenger_server *serv,
+                          std::shared_ptr<boost::asio::ip::tcp::socket> sock,
+                          std::shared_ptr<char[]> data, uint64_t len) {
+  auto res = messenger::deserializer::deserialize(data, len);
+  auto pack = std::get_if<messenger::network_packets::merkle_node>(&res);
+  if (pack == nullptr) {
+    serv->read_frames(sock);
+    return;
+  }
+  auto reply = [serv, sock](messenger::network_packets::merkle_node pack) {
+    auto frame = messenger::deserializer::serialize_frame(pack);
+    boost::asio::async_write(
+        *sock, boost::asio::buffer(frame.first.get(), frame.second),
+        [serv, sock, frame](const boost::system::error_code ec, uint64_t) {
+          if (!ec) {
+            serv->read_frames(sock);
+          }
+        });
+  };
+  auto chat_inst = serv->get_chat_list().find(pack->chat_id);
+  if (chat_inst == nullptr) {
+    reply(std::move(*pack));
+    return;
+  }
+  boost::asio::post(
+      chat_inst->get_strand(),
+      [chat_inst, reply, pack = std::move(*pack)]() mutable {
+        pack.leaf_count = chat_inst->merkle_leaves();
+        auto node = chat_inst->merkle_node(pack.level, pack.index);
+        if (node) {
+          pack.digest.assign(node->begin(), node->end());
+        }
+        reply(std::move(pack));
+      });
+}
+
+constexpr std::array<frame_handler, messenger::network_type_count>
+make_frame_handlers() {
+  std::array<frame_handler, messenger::network_type_count> table{};
+  table[messenger::network_type::dialog_text] = &dispatch_dialog_text;
+  table[messenger::network_type::paxos_notif] = &dispatch_paxos_notif;
+  table[messenger::network_type::paxos_push] = &dispatch_paxos_push;
+  table[messenger::network_type::chat_sync] = &dispatch_chat_sync;
+  table[messenger::network_type::dialog_session_text] =
+      &dispatch_dialog_session_text;
+  table[messenger::network_type::merkle_node] = &dispatch_merkle_node;
+  table[messenger::network_type::paxos_commit] = &dispatch_paxos_commit;
+  return table;
+}
+
+constexpr auto frame_handlers = make_frame_handlers();
+} // namespace
+
+// frame: network_type byte and packet body
+void messenger::network::handle_reply(messenger_server *serv,
+                                      std::shared_ptr<char[]> data,
+                                      uint64_t len) {
+  messenger::reader data_reader(data.get(), len);
+  char msg_type = 0;
+  std::string session_id(session_cache::session_id_len, '\0');
+  uint64_t seq = 0;
+  data_reader.read_sequentially(&msg_type, sizeof(msg_type));
+  data_reader.read_sequentially(session_id.data(), session_id.size());
+  bool res = data_reader.read_sequentially((char *)(&seq), sizeof(seq));
+  if (!res || msg_type != network_type::dialog_session_reject) {
+    return;
+  }
+  auto rejected = serv->get_sessions().reject(session_id, seq);
+  if (rejected) {
+    resend_rejected(
+        serv,
+        std::make_shared<session_cache::rejected_session>(
+            std::move(*rejected)),
+        0);
+  }
+}
 
 void messenger::network::messenger_server::do_accept() {
 
-  acceptor_.async_accept([this](boost::system::error_code ec,
-                                boost::asio::ip::tcp::socket socket) {
+  // the accepted socket is served by the shard it is created on
+  auto &shard = shards != nullptr ? shards->next() : io_context;
+  acceptor_.async_accept(shard, [this](boost::system::error_code ec,
+                                       boost::asio::ip::tcp::socket socket) {
     if (!ec) {
-
-      std::shared_ptr<ip::tcp::socket> sock(
-          std::make_shared<ip::tcp::socket>(std::move(socket)));
-      std::shared_ptr<char> msg_type(new char);
-      boost::asio::async_read(
-          *sock, boost::asio::buffer(msg_type.get(), 1),
-          [msg_type, this, sock](boost::system::error_code ec, uint64_t) {
-            if (*msg_type == messenger::network_type::dialog_text) {
-              accept_dialog_msg(
-                  sock, this->keys,
-                  [this](boost::system::error_code ec,
-                         std::variant<network_packets::dialog_text> res) {
-                    if (std::get_if<network_packets::dialog_text>(&res) !=
-                        nullptr) {
-                      this->dialog_text_handler(
-                          *std::get_if<network_packets::dialog_text>(&res));
-                    }
-                  });
-            }
-          });
+      read_frames(std::make_shared<ip::tcp::socket>(std::move(socket)));
     } else {
       std::cout << ec.message() << '\n';
     }
@@ -34,68 +238,190 @@ void messenger::network::messenger_server::do_accept() {
   });
 }
 
+// frame: uint64_t length, then network_type byte and packet body
+void messenger::network::messenger_server::read_frames(
+    std::shared_ptr<ip::tcp::socket> sock) {
+  // prefix, frame and handler state all come from the frame pool
+  auto len = std::allocate_shared<uint64_t>(
+      frame_pool::allocator<uint64_t>(&frames), 0);
+  boost::asio::async_read(
+      *sock, boost::asio::buffer(len.get(), sizeof(*len)),
+      bind_pool(frames, [this, sock, len](boost::system::error_code ec,
+                                          uint64_t) {
+        if (ec || *len == 0 || *len > max_frame_len) {
+          return;
+        }
+        auto data = frames.acquire(*len);
+        boost::asio::async_read(
+            *sock, boost::asio::buffer(data.get(), *len),
+            bind_pool(frames, [this, sock, len,
+                               data](boost::system::error_code ec, uint64_t) {
+              if (ec) {
+                return;
+              }
+              auto type = deserializer::packet_type(data.get(), *len);
+              if (type >= 0 && type < int(frame_handlers.size()) &&
+                  frame_handlers[type] != nullptr) {
+                frame_handlers[type](this, sock, data, *len);
+              } else {
+                read_frames(sock);
+              }
+            }));
+      }));
+}
+
 void messenger::network::handle_paxos_notif(
     messenger_server *serv,
     std::shared_ptr<network_packets::paxos_notif_packet> pack) {
-  std::unique_lock ul{serv->get_paxos_list().second};
-  auto it = serv->get_paxos_list().first.find(pack->chat_id);
-  if (it != serv->get_paxos_list().first.end()) {
-    it->second.accept_promise(pack->id, pack->hash);
+  auto paxos_instance = serv->get_paxos_list().find(pack->chat_id);
+  auto id = id_interner::global().find(pack->id);
+  if (paxos_instance != nullptr && id) {
+    boost::asio::post(paxos_instance->get_strand(),
+                      [paxos_instance, pack, id = *id]() {
+                        paxos_instance->accept_promise(id, pack->seq,
+                                                       pack->hash);
+                      });
+  }
+}
+
+void messenger::network::handle_paxos_commit(
+    messenger_server *serv,
+    std::shared_ptr<network_packets::paxos_commit_packet> pack) {
+  auto paxos_instance = serv->get_paxos_list().find(pack->chat_id);
+  auto id = id_interner::global().find(pack->id);
+  if (paxos_instance != nullptr && id) {
+    boost::asio::post(paxos_instance->get_strand(),
+                      [serv, paxos_instance, pack, id = *id]() {
+                        // the committer has the slot this replica missed
+                        if (paxos_instance->accept_commit(id, pack->seq,
+                                                          pack->hash)) {
+                          reconcile_chat(serv, pack->id, pack->chat_id);
+                        }
+                      });
   }
 }
 
 void messenger::network::handle_paxos_push(
     messenger_server *serv,
     std::shared_ptr<network_packets::paxos_push_packet> pack) {
-  std::scoped_lock sl{serv->get_chat_list().second,
-                      serv->get_paxos_list().second};
-  auto chat_it = serv->get_chat_list().first.find(pack->chat_id);
-  auto paxos_it = serv->get_paxos_list().first.find(pack->chat_id);
-  if ((chat_it != serv->get_chat_list().first.end()) &&
-      (paxos_it != serv->get_paxos_list().first.end())) {
-    auto chat_instance = &chat_it->second;
-    auto paxos_instance = &paxos_it->second;
-    uint64_t current_time =
-        std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::system_clock::now().time_since_epoch())
-            .count();
-    auto &c_event = pack->c_event;
-    if (c_event->time >= current_time) {
-
-      std::shared_ptr<boost::asio::steady_timer> paxos_start_timer(
-          new boost::asio::steady_timer(
-              serv->get_io(),
-              boost::asio::chrono::milliseconds(c_event->time - current_time)));
-
-      paxos_start_timer->async_wait([&paxos_instance, c_event, &chat_instance,
-                                     serv, paxos_start_timer](
-                                        const boost::system::error_code &ec) {
-        if (paxos_instance->correct_action(c_event)) {
-          // send notif
-          messenger::network_packets::paxos_notif_packet pack;
-          std::memcpy(pack.chat_id, chat_instance->chat_id().c_str(),
-                      chat_instance->chat_id().size());
-          std::memcpy(pack.id, chat_instance->get_my_id().c_str(),
-                      chat_instance->get_my_id().size());
-          std::memcpy(pack.hash, chat_instance->new_hash(c_event).c_str(),
-                      chat_instance->new_hash(c_event).size());
-          auto ser_res = deserializer::serialize(pack);
-          auto data = ser_res.first;
-          auto len = ser_res.second;
-          std::shared_ptr<char[]> data_with_len(new char[len + sizeof(len)]);
-          std::memcpy(data_with_len.get(), &len, sizeof(len));
-          std::memcpy(data_with_len.get() + sizeof(len), data.get(), len);
-          paxos_instance->loop_through_users(
-              [serv, data_with_len, len = len + sizeof(len)](
-                  std::pair<const std::string, uint32_t> &participant) {
-                serv->async_send(data_with_len, len, participant.first,
-                                 [](const boost::system::error_code ec) {});
-              });
-          paxos_instance->start_accept(c_event, 1000);
-        }
+  auto chat_instance = serv->get_chat_list().find(pack->chat_id);
+  auto paxos_instance = serv->get_paxos_list().find(pack->chat_id);
+  if ((chat_instance == nullptr) || (paxos_instance == nullptr)) {
+    return;
+  }
+  // the round starts on receipt, the batch is one proposal and every
+  // replica must accept all of it
+  if (pack->events.empty()) {
+    return;
+  }
+  for (auto &i : pack->events) {
+    if (!paxos_instance->correct_action(i)) {
+      return;
+    }
+  }
+  boost::asio::post(paxos_instance->get_strand(), [serv, chat_instance,
+                                                   paxos_instance, pack]() {
+    auto ticket = paxos_instance->start_accept(pack->events);
+    if (ticket) {
+      // send notif
+      messenger::network_packets::paxos_notif_packet notif;
+      notif.chat_id = chat_instance->chat_id();
+      notif.id = chat_instance->get_my_id();
+      notif.hash = std::move(ticket->hash);
+      notif.seq = ticket->seq;
+      id_handle my_handle = id_interner::global().intern(notif.id);
+      paxos_instance->accept_promise(my_handle, notif.seq, notif.hash);
+      send_to_others(serv, paxos_instance, my_handle,
+                     deserializer::serialize_frame(notif));
+    }
+  });
+}
+
+void messenger::network::propose_event(messenger_server *serv,
+                                       std::string chat_id,
+                                       std::shared_ptr<chat_event> c_event,
+                                       paxos::commit_handler done) {
+  auto chat_inst = serv->get_chat_list().find(chat_id);
+  auto paxos_instance = serv->get_paxos_list().find(chat_id);
+  if ((chat_inst == nullptr) || (paxos_instance == nullptr)) {
+    if (done) {
+      boost::asio::post(serv->get_io(), [done]() {
+        done(paxos_errors::force_stop, 0);
       });
     }
+    return;
   }
+  std::string my_id = chat_inst->get_my_id();
+  id_handle my_handle = id_interner::global().intern(my_id);
+  auto propose = [serv, paxos_instance, chat_id, my_id,
+                  my_handle](std::vector<std::shared_ptr<chat_event>> batch,
+                             std::vector<paxos::commit_handler> waiters) {
+    network_packets::paxos_push_packet pack;
+    pack.chat_id = chat_id;
+    pack.id = my_id;
+    pack.time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count();
+    pack.events = batch;
+    auto frame = deserializer::serialize_frame(pack);
+    // the proposer's slot is opened here, so it holds the waiters and
+    // broadcasts the commit as soon as its own quorum is reached
+    std::optional<paxos::ticket> ticket;
+    if (frame.first != nullptr) {
+      // known before start_accept, which may reach quorum and notify the
+      // waiters on another thread before it returns
+      auto hash = paxos_instance->next_hash(batch);
+      waiters.push_back([serv, paxos_instance, chat_id, my_id, my_handle,
+                         hash](uint32_t ec, uint64_t seq) {
+        if (ec != paxos_errors::ok) {
+          return;
+        }
+        network_packets::paxos_commit_packet commit;
+        commit.chat_id = chat_id;
+        commit.id = my_id;
+        commit.seq = seq;
+        commit.hash = hash;
+        send_to_others(serv, paxos_instance, my_handle,
+                       deserializer::serialize_frame(commit));
+      });
+      ticket = paxos_instance->start_accept(std::move(batch), waiters);
+    }
+    if (!ticket) {
+      for (auto &i : waiters) {
+        boost::asio::post(serv->get_io(), [i]() {
+          i(paxos_errors::paxos_busy, 0);
+        });
+      }
+      return;
+    }
+    send_to_others(serv, paxos_instance, my_handle, frame);
+    network_packets::paxos_notif_packet notif;
+    notif.chat_id = chat_id;
+    notif.id = my_id;
+    notif.hash = std::move(ticket->hash);
+    notif.seq = ticket->seq;
+    paxos_instance->accept_promise(my_handle, notif.seq, notif.hash);
+    send_to_others(serv, paxos_instance, my_handle,
+                   deserializer::serialize_frame(notif));
+  };
+  boost::asio::post(paxos_instance->get_strand(),
+                    [paxos_instance, c_event = std::move(c_event),
+                     done = std::move(done), propose]() mutable {
+                      paxos_instance->propose_event(
+                          std::move(c_event), std::move(done), propose);
+                    });
+}
+
+void messenger::network::send_to_others(
+    messenger_server *serv, paxos *paxos_instance, id_handle my_id,
+    std::pair<std::shared_ptr<char[]>, uint64_t> frame) {
+  paxos_instance->loop_through_users(
+      [serv, my_id, &frame](const paxos::participant &participant) {
+        if (participant.id != my_id) {
+          serv->async_send(frame.first, frame.second, participant.id,
+                           [](const boost::system::error_code ec) {});
+        }
+      });
 }
 
 void messenger::network::handle_dialog_text(
@@ -106,97 +432,230 @@ void messenger::network::request_chat(messenger_server *serv, std::string id,
                                       std::string chat_id) {
   serv->async_connect(id, [serv, chat_id](boost::asio::ip::tcp::socket sock,
                                           const boost::system::error_code ec) {
-    std::unique_lock ul{serv->get_chat_list().second};
-    auto chat_inst_it = serv->get_chat_list().first.find(chat_id);
-    if (chat_inst_it != serv->get_chat_list().first.end()) {
-      auto chat_inst = &chat_inst_it->second;
+    auto chat_inst = serv->get_chat_list().find(chat_id);
+    if (chat_inst == nullptr) {
+      return;
+    }
+    std::shared_ptr<ip::tcp::socket> ptr(
+        std::make_shared<ip::tcp::socket>(std::move(sock)));
+    boost::asio::post(chat_inst->get_strand(), [chat_inst, chat_id, ptr]() {
       messenger::network_packets::request_chat_hash pack;
-      std::memcpy(pack.chat_id, chat_id.c_str(), chat_id.size());
-      std::memcpy(pack.id, chat_inst->get_my_id().c_str(),
-                  chat_inst->get_my_id().size());
+      pack.chat_id = chat_id;
+      pack.id = chat_inst->get_my_id();
+      pack.history_len = chat_inst->size();
+      pack.history_hash = chat_inst->history_hash(pack.history_len);
       pack.time = std::chrono::duration_cast<std::chrono::milliseconds>(
                       std::chrono::system_clock::now().time_since_epoch())
                       .count();
-      auto data = messenger::deserializer::serialize(pack);
-      uint64_t len = data.second;
-      std::shared_ptr<char[]> data_with_len(new char[len + sizeof(len)]);
-      std::memcpy(data_with_len.get(), &len, sizeof(len));
-      std::memcpy(data_with_len.get() + sizeof(len), data.first.get(), len);
-      std::shared_ptr<ip::tcp::socket> ptr(
-          std::make_shared<ip::tcp::socket>(std::move(sock)));
+      auto frame = messenger::deserializer::serialize_frame(pack);
       boost::asio::async_write(
-          *ptr, boost::asio::buffer(data_with_len.get(), len + sizeof(len)),
-          [data_with_len, chat_inst, ptr](const boost::system::error_code ec,
-                                          uint64_t) {
+          *ptr, boost::asio::buffer(frame.first.get(), frame.second),
+          [frame, chat_inst, ptr](const boost::system::error_code ec,
+                                  uint64_t) {
             if (!ec) {
-              chat_inst->clear();
-              messenger::network::handle_chat_sync_event(chat_inst, ptr);
+              boost::asio::co_spawn(
+                  chat_inst->get_strand(),
+                  messenger::network::handle_chat_sync_event(chat_inst, ptr),
+                  boost::asio::detached);
             }
           });
-    }
+    });
   });
 }
 
-void messenger::network::handle_chat_sync_event(
+// runs on the chat's strand, so chunks are applied there
+boost::asio::awaitable<void> messenger::network::handle_chat_sync_event(
     messenger::chat *chat_inst, std::shared_ptr<ip::tcp::socket> ptr) {
-  std::shared_ptr<uint64_t> len(new uint64_t(0));
-  boost::asio::async_read(
-      *ptr, boost::asio::buffer(len.get(), sizeof(*len)),
-      [ptr, len, chat_inst](const boost::system::error_code ec, uint64_t) {
-        if (!ec) {
-          std::shared_ptr<char[]> data(new char[*len]);
-          boost::asio::async_read(
-              *ptr, boost::asio::buffer(data.get(), *len),
-              [data, len, chat_inst, ptr](const boost::system::error_code ec,
-                                          uint64_t) {
-                if (!ec) {
-                  auto res_v = deserializer::deserialize(data, *len);
-                  auto push_res =
-                      std::get_if<network_packets::paxos_push_packet>(&res_v);
-
-                  if (push_res != nullptr) {
-                    std::shared_ptr<network_packets::paxos_push_packet> pptr(
-                        new network_packets::paxos_push_packet);
-                    *pptr = *push_res;
-                    chat_inst->add(pptr->c_event);
-                  }
-
-                  messenger::network::handle_chat_sync_event(chat_inst, ptr);
-                }
-              });
-        }
-      });
+  uint64_t len = 0;
+  uint64_t capacity = 0;
+  std::shared_ptr<char[]> data;
+  for (;;) {
+    co_await boost::asio::async_read(*ptr,
+                                     boost::asio::buffer(&len, sizeof(len)),
+                                     boost::asio::use_awaitable);
+    if (len > messenger_server::max_frame_len) {
+      co_return;
+    }
+    // chunks are at most history_chunk_size, the buffer is reused
+    if (len > capacity) {
+      data.reset(new char[len]);
+      capacity = len;
+    }
+    co_await boost::asio::async_read(*ptr, boost::asio::buffer(data.get(), len),
+                                     boost::asio::use_awaitable);
+    auto res_v = deserializer::deserialize(data, len);
+    auto chunk = std::get_if<network_packets::chat_history_chunk>(&res_v);
+    if (chunk != nullptr) {
+      // the first chunk, or one of a restarted stream, rewinds a diverged
+      // suffix
+      if (!chat_inst->add(chunk->first_index, std::move(chunk->events)) ||
+          chunk->last) {
+        co_return;
+      }
+    }
+  }
 }
 
-void messenger::network::share_chat_history(
-    messenger_server *serv,
-    std::shared_ptr<network_packets::request_chat_hash> pack,
-    std::shared_ptr<boost::asio::ip::tcp::socket> ptr, uint64_t ind = 0) {
-  std::unique_lock ul{serv->get_chat_list().second};
-  auto chat_it = serv->get_chat_list().first.find(pack->chat_id);
-  auto chat_inst = &chat_it->second;
-  auto el = chat_inst->get(ind);
-  if (el != nullptr) {
-    std::pair<std::shared_ptr<char[]>, uint64_t> ser_res;
-    if (el->event_type == messenger::chat_event_types::chat_text_type) {
-      messenger::network_packets::paxos_push_packet evpack;
-      std::memcpy(evpack.chat_id, chat_inst->chat_id().c_str(),
-                  chat_inst->chat_id().size());
-      std::memcpy(evpack.id, chat_inst->get_my_id().c_str(),
-                  chat_inst->get_my_id().size());
-      evpack.c_event = el;
-      evpack.time = 0;
-      auto data = messenger::deserializer::serialize(evpack);
-      uint64_t len = data.second;
-      std::shared_ptr<char[]> data_with_len(new char[len + sizeof(len)]);
-      std::memcpy(data_with_len.get(), &len, sizeof(len));
-      std::memcpy(data_with_len.get() + sizeof(len), data.first.get(), len);
-      boost::asio::async_write(
-          *ptr, boost::asio::buffer(data_with_len.get(), len + sizeof(len)),
-          [ptr, data_with_len, ind, evpack, serv,
-           pack](const boost::system::error_code ec, uint64_t) {
-            share_chat_history(serv, pack, ptr, ind + 1);
-          });
+// runs on the chat's strand, the next chunk is encoded only after the
+// previous one left the socket
+boost::asio::awaitable<void> messenger::network::share_chat_history(
+    messenger_server *serv, messenger::chat *chat_inst,
+    network_packets::request_chat_hash pack,
+    std::shared_ptr<boost::asio::ip::tcp::socket> ptr) {
+  // only the missing suffix if the requester's history is our prefix
+  auto first_index = [chat_inst, &pack]() -> uint64_t {
+    if (pack.history_len > 0 &&
+        chat_inst->history_hash(pack.history_len) == pack.history_hash) {
+      return pack.history_len;
+    }
+    return 0;
+  };
+  // views are taken per chunk and a sync may rewrite the history while a
+  // chunk is written. The prefix hash up to the end of the chunk is checked
+  // after every write, on a change the stream starts over and the
+  // requester's indexed add rewinds to it.
+  constexpr int max_restarts = 4;
+  int restarts = 0;
+  uint64_t pos = first_index();
+  bool last = false;
+  while (!last) {
+    std::vector<chat_event_view> events;
+    uint64_t size = 0;
+    for (auto ev = chat_inst->get(pos); ev; ev = chat_inst->get(pos)) {
+      uint64_t event_size = deserializer::event_size(*ev);
+      if (!events.empty() &&
+          size + event_size > network_packets::history_chunk_size) {
+        break;
+      }
+      size += event_size;
+      events.push_back(*ev);
+      pos++;
+    }
+    last = pos >= chat_inst->size();
+    auto frame = deserializer::serialize_history_chunk(
+        pack.chat_id, pos - events.size(), last, events.begin(), events.end());
+    auto sent_hash = chat_inst->history_hash(pos);
+    co_await boost::asio::async_write(
+        *ptr, boost::asio::buffer(frame.first.get(), frame.second),
+        boost::asio::use_awaitable);
+    if (chat_inst->history_hash(pos) != sent_hash) {
+      if (++restarts > max_restarts) {
+        // the requester sees the connection end before the last chunk
+        boost::system::error_code ignored;
+        ptr->close(ignored);
+        co_return;
+      }
+      pos = first_index();
+      last = false;
     }
   }
-}
\ No newline at end of file
+  serv->read_frames(ptr);
+}
+
+void messenger::network::reconcile_chat(messenger_server *serv, std::string id,
+                                        std::string chat_id) {
+  serv->async_connect(id, [serv, chat_id](boost::asio::ip::tcp::socket sock,
+                                          const boost::system::error_code ec) {
+    if (ec) {
+      return;
+    }
+    auto chat_inst = serv->get_chat_list().find(chat_id);
+    if (chat_inst == nullptr) {
+      return;
+    }
+    std::shared_ptr<ip::tcp::socket> ptr(
+        std::make_shared<ip::tcp::socket>(std::move(sock)));
+    // leaf 0 doubles as the leaf count query
+    query_merkle_node(
+        ptr, chat_id, 0, 0,
+        boost::asio::bind_executor(
+            chat_inst->get_strand(),
+            [chat_inst,
+             ptr](std::shared_ptr<network_packets::merkle_node> reply) {
+              auto common =
+                  std::min(chat_inst->merkle_leaves(), reply->leaf_count);
+              auto peaks =
+                  std::make_shared<std::vector<std::pair<uint32_t, uint64_t>>>(
+                      merkle_tree::peaks(common));
+              compare_merkle_peaks(chat_inst, ptr, peaks, 0, common);
+            }));
+  });
+}
+
+void messenger::network::compare_merkle_peaks(
+    messenger::chat *chat_inst, std::shared_ptr<ip::tcp::socket> ptr,
+    std::shared_ptr<std::vector<std::pair<uint32_t, uint64_t>>> peaks,
+    uint64_t pos, uint64_t common) {
+  if (pos == peaks->size()) {
+    // every shared block matches, only the tails can differ
+    fetch_chat_history(chat_inst, ptr, common * chat::merkle_block);
+    return;
+  }
+  auto [level, index] = (*peaks)[pos];
+  query_merkle_node(
+      ptr, chat_inst->chat_id(), level, index,
+      boost::asio::bind_executor(
+          chat_inst->get_strand(),
+          [chat_inst, ptr, peaks, pos, common, level = level, index = index](
+              std::shared_ptr<network_packets::merkle_node> reply) {
+            if (merkle_node_matches(chat_inst, *reply)) {
+              compare_merkle_peaks(chat_inst, ptr, peaks, pos + 1, common);
+            } else {
+              descend_merkle_tree(chat_inst, ptr, level, index);
+            }
+          }));
+}
+
+// node (level, index) differs, finds its leftmost differing leaf
+void messenger::network::descend_merkle_tree(
+    messenger::chat *chat_inst, std::shared_ptr<ip::tcp::socket> ptr,
+    uint32_t level, uint64_t index) {
+  if (level == 0) {
+    fetch_chat_history(chat_inst, ptr, index * chat::merkle_block);
+    return;
+  }
+  query_merkle_node(
+      ptr, chat_inst->chat_id(), level - 1, 2 * index,
+      boost::asio::bind_executor(
+          chat_inst->get_strand(),
+          [chat_inst, ptr, level,
+           index](std::shared_ptr<network_packets::merkle_node> reply) {
+            // a matching left child means the right one differs
+            uint64_t child = 2 * index;
+            if (merkle_node_matches(chat_inst, *reply)) {
+              child++;
+            }
+            descend_merkle_tree(chat_inst, ptr, level - 1, child);
+          }));
+}
+
+bool messenger::network::merkle_node_matches(
+    messenger::chat *chat_inst, const network_packets::merkle_node &reply) {
+  auto node = chat_inst->merkle_node(reply.level, reply.index);
+  return node && reply.digest == std::string(node->begin(), node->end());
+}
+
+// history before pos is shared, asks for everything after it
+void messenger::network::fetch_chat_history(
+    messenger::chat *chat_inst, std::shared_ptr<ip::tcp::socket> ptr,
+    uint64_t pos) {
+  messenger::network_packets::request_chat_hash pack;
+  pack.chat_id = chat_inst->chat_id();
+  pack.id = chat_inst->get_my_id();
+  pack.history_len = pos;
+  pack.history_hash = chat_inst->history_hash(pos);
+  pack.time = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  std::chrono::system_clock::now().time_since_epoch())
+                  .count();
+  auto frame = messenger::deserializer::serialize_frame(pack);
+  boost::asio::async_write(
+      *ptr, boost::asio::buffer(frame.first.get(), frame.second),
+      [frame, chat_inst, ptr](const boost::system::error_code ec, uint64_t) {
+        if (!ec) {
+          boost::asio::co_spawn(
+              chat_inst->get_strand(),
+              messenger::network::handle_chat_sync_event(chat_inst, ptr),
+              boost::asio::detached);
+        }
+      });
+}
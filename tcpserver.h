@@ -3,8 +3,17 @@
 
 #include "chat.h"
 #include "chat_info_list.h"
+#include "connection_pool.h"
 #include "deserializer.h"
+#include "endpoint_cache.h"
+#include "frame_pool.h"
+#include "id_interner.h"
+#include "io_pool.h"
+#include "key_cache.h"
+#include "key_pool.h"
 #include "paxos.h"
+#include "session_cache.h"
+#include "thread_safe_structures.h"
 #include <boost/asio.hpp>
 #include <cryptopp/rsa.h>
 #include <functional>
@@ -18,89 +27,99 @@ namespace messenger {
 namespace network {
 using namespace boost::asio;
 
+using chat_registry = sharded_registry<std::string, messenger::chat>;
+using paxos_registry = sharded_registry<std::string, messenger::paxos>;
+
+class messenger_server;
+
+// frames peers write back on our outgoing connections
+void handle_reply(messenger_server *serv, std::shared_ptr<char[]> data,
+                  uint64_t len);
+
 class messenger_server {
 public:
   messenger_server(
-      short port,
-      std::pair<std::map<std::string, messenger::chat>, std::mutex> &c_list,
-      std::pair<std::map<std::string, messenger::paxos>, std::mutex> &p_list,
+      short port, chat_registry &c_list, paxos_registry &p_list,
       thread_safe_map<std::string, std::pair<std::string, char>> &ip_id,
+      endpoint_cache &ep_cache, frame_pool &frame_buffers,
       CryptoPP::RSA::PrivateKey prk, CryptoPP::RSA::PublicKey pbk,
-      boost::asio::io_context &io)
-      : chat_list(c_list), paxos_list(p_list), resolver(io),
+      boost::asio::io_context &io, io_pool *io_shards = nullptr)
+      : keys(pbk, prk),
         acceptor_(io, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(),
                                                      port)),
-        io_context(io), ip_from_id(ip_id), keys(pbk, prk) {
+        io_context(io), shards(io_shards), chat_list(c_list),
+        paxos_list(p_list), ip_from_id(ip_id), endpoints(ep_cache),
+        frames(frame_buffers),
+        pool(io, std::chrono::seconds(60), 2, std::chrono::milliseconds(100),
+             [this](const std::string &id) -> boost::asio::io_context & {
+               return shard_for(id);
+             },
+             [this](id_handle, std::shared_ptr<char[]> data, uint64_t len) {
+               handle_reply(this, std::move(data), len);
+             }) {
     std::cout << acceptor_.local_endpoint() << std::endl;
     do_accept();
   }
 
+  // sharded mode: accepted sockets go to the shards round-robin, peer
+  // connections and chats live on the shard their id hashes to
+  messenger_server(
+      short port, chat_registry &c_list, paxos_registry &p_list,
+      thread_safe_map<std::string, std::pair<std::string, char>> &ip_id,
+      endpoint_cache &ep_cache, frame_pool &frame_buffers,
+      CryptoPP::RSA::PrivateKey prk, CryptoPP::RSA::PublicKey pbk,
+      io_pool &io_shards)
+      : messenger_server(port, c_list, p_list, ip_id, ep_cache, frame_buffers,
+                         prk, pbk, io_shards.get(0), &io_shards) {}
+
+  // io_context that owns a chat or peer, chats must be created on it
+  boost::asio::io_context &shard_for(const std::string &key) {
+    return shards != nullptr ? shards->for_key(key) : io_context;
+  }
+
+  // data must already be framed, the socket is reused for later packets
   template <typename functor>
   void async_send(std::shared_ptr<char[]> data, uint64_t len,
-                  const std::string id, functor handler) {
-
-    std::string host, port;
-    std::string add = this->ip_from_id.get(id).first;
-    auto pos = add.find(':');
-    if (pos != std::string::npos) {
-      host = add.substr(0, pos);
-      port = add.substr(pos + 1);
-    }
+                  const std::string &id, functor handler) {
+    async_send(std::move(data), len, id_interner::global().intern(id),
+               std::move(handler));
+  }
 
-    resolver.async_resolve(
-        host, port,
-        [this, handler, data,
-         len](const boost::system::error_code &ec,
-              boost::asio::ip::tcp::resolver::results_type results) {
-          if (!ec) {
-            std::shared_ptr<boost::asio::ip::tcp::socket> socket_ptr =
-                std::make_shared<boost::asio::ip::tcp::socket>(
-                    this->io_context);
-            boost::asio::async_connect(
-                *socket_ptr, results,
-                [socket_ptr, handler, data,
-                 len](const boost::system::error_code &ec,
-                      const boost::asio::ip ::tcp::endpoint &) {
-                  if (!ec) {
-                    boost::asio::async_write(
-                        *socket_ptr, boost::asio::buffer(data.get(), len),
-                        [handler, socket_ptr,
-                         data](const boost::system::error_code &ec,
-                               uint64_t bytes) { handler(ec); });
-                  } else {
-                    handler(ec);
-                  }
-                });
-          } else {
-            handler(ec);
-          }
-        });
+  template <typename functor>
+  void async_send(std::shared_ptr<char[]> data, uint64_t len, id_handle id,
+                  functor handler) {
+    pool.async_send(
+        id, std::move(data), len,
+        [this, id](connection_pool::connect_handler connected) {
+          this->async_connect(id_interner::global().name(id),
+                              std::move(connected));
+        },
+        std::move(handler));
   }
 
   template <typename functor>
   void async_connect(const std::string id, functor handler) {
-
-    std::string host, port;
-    std::string add = this->ip_from_id.get(id).first;
-    auto pos = add.find(':');
-    if (pos != std::string::npos) {
-      host = add.substr(0, pos);
-      port = add.substr(pos + 1);
+    if (!endpoints.contains(id)) { // contact added without the cache
+      auto address = this->ip_from_id.find(id);
+      if (address) {
+        endpoints.add(id, address->first);
+      }
     }
-
-    resolver.async_resolve(
-        host, port,
-        [this, handler](const boost::system::error_code &ec,
-                        boost::asio::ip::tcp::resolver::results_type results) {
+    endpoints.async_resolve(
+        shard_for(id), id,
+        [this, id, handler](
+            const boost::system::error_code &ec,
+            std::shared_ptr<const endpoint_cache::endpoints_type> results) {
           if (!ec) {
             std::shared_ptr<boost::asio::ip::tcp::socket> socket_ptr =
                 std::make_shared<boost::asio::ip::tcp::socket>(
-                    this->io_context);
+                    this->shard_for(id));
 
             boost::asio::async_connect(
-                *socket_ptr, results,
-                [socket_ptr, handler](const boost::system::error_code &ec,
-                                      const boost::asio::ip ::tcp::endpoint &) {
+                *socket_ptr, *results,
+                [socket_ptr, handler,
+                 results](const boost::system::error_code &ec,
+                          const boost::asio::ip ::tcp::endpoint &) {
                   handler(std::move(*socket_ptr), ec);
                 });
           } else {
@@ -109,14 +128,27 @@ public:
         });
   }
 
+  // reads framed packets from an accepted socket and dispatches them by type
+  void read_frames(std::shared_ptr<ip::tcp::socket> sock);
+
+  static constexpr uint64_t max_frame_len = 64 << 20;
+
   auto &get_chat_list() { return chat_list; }
   auto &get_paxos_list() { return paxos_list; }
 
   auto &get_io() { return io_context; }
   auto &get_ip_from_id() { return ip_from_id; }
+  auto &get_endpoints() { return endpoints; }
+  auto &get_sessions() { return sessions; }
+  auto &get_sign_keys() { return sign_keys; }
+  auto &get_rsa_keys() { return rsa_keys; }
+  auto &get_pool() { return pool; }
+  auto &get_frames() { return frames; }
 
   std::pair<CryptoPP::RSA::PublicKey, CryptoPP::RSA::PrivateKey> keys;
-  std::function<void(messenger::network_packets::dialog_text)>
+  // the text and its sender's fingerprint, checked against the signature
+  std::function<void(messenger::network_packets::dialog_text,
+                     digital_signature::key_fingerprint)>
       dialog_text_handler;
 
 private:
@@ -124,10 +156,18 @@ private:
 
   boost::asio::ip::tcp::acceptor acceptor_;
   boost::asio::io_context &io_context;
-  boost::asio::ip::tcp::resolver resolver;
-  std::pair<std::map<std::string, messenger::chat>, std::mutex> &chat_list;
-  std::pair<std::map<std::string, messenger::paxos>, std::mutex> &paxos_list;
+  io_pool *shards = nullptr;
+  chat_registry &chat_list;
+  paxos_registry &paxos_list;
   thread_safe_map<std::string, std::pair<std::string, char>> &ip_from_id;
+  endpoint_cache &endpoints;
+  session_cache sessions;
+  key_cache sign_keys;
+  key_pool rsa_keys;
+  // handlers still queued on the io_contexts free into it when they are
+  // destroyed, so it must outlive them
+  frame_pool &frames;
+  connection_pool pool;
 };
 
 void handle_paxos_notif(
@@ -138,18 +178,110 @@ void handle_paxos_push(
     messenger_server *serv,
     std::shared_ptr<network_packets::paxos_push_packet> pack);
 
+void handle_paxos_commit(
+    messenger_server *serv,
+    std::shared_ptr<network_packets::paxos_commit_packet> pack);
+
+// queues a local event into the chat's next batch proposal, done gets the
+// paxos_errors outcome once the batch is committed or failed
+void propose_event(messenger_server *serv, std::string chat_id,
+                   std::shared_ptr<chat_event> c_event,
+                   paxos::commit_handler done = nullptr);
+
+void send_to_others(messenger_server *serv, paxos *paxos_instance,
+                    id_handle my_id,
+                    std::pair<std::shared_ptr<char[]>, uint64_t> frame);
+
 void handle_dialog_text(messenger_server *serv,
                         std::shared_ptr<network_packets::dialog_text> pack);
 
 void request_chat(messenger_server *serv, std::string id, std::string chat_id);
 
-void handle_chat_sync_event(messenger::chat *chat_inst,
-                            std::shared_ptr<ip::tcp::socket> ptr);
+// reads history chunks until the last one, spawn on the chat's strand
+boost::asio::awaitable<void>
+handle_chat_sync_event(messenger::chat *chat_inst,
+                       std::shared_ptr<ip::tcp::socket> ptr);
 
-void share_chat_history(
-    messenger_server *serv,
-    std::shared_ptr<network_packets::request_chat_hash> pack,
-    std::shared_ptr<boost::asio::ip::tcp::socket> ptr, uint64_t ind);
+// streams the history pack asks for and resumes frames on ptr, spawn on the
+// chat's strand
+boost::asio::awaitable<void>
+share_chat_history(messenger_server *serv, messenger::chat *chat_inst,
+                   network_packets::request_chat_hash pack,
+                   std::shared_ptr<boost::asio::ip::tcp::socket> ptr);
+
+// finds the first history block that differs from id's replica in O(log n)
+// merkle_node round trips and syncs only from there on
+void reconcile_chat(messenger_server *serv, std::string id,
+                    std::string chat_id);
+
+void compare_merkle_peaks(
+    messenger::chat *chat_inst, std::shared_ptr<ip::tcp::socket> ptr,
+    std::shared_ptr<std::vector<std::pair<uint32_t, uint64_t>>> peaks,
+    uint64_t pos, uint64_t common);
+
+void descend_merkle_tree(messenger::chat *chat_inst,
+                         std::shared_ptr<ip::tcp::socket> ptr, uint32_t level,
+                         uint64_t index);
+
+bool merkle_node_matches(messenger::chat *chat_inst,
+                         const network_packets::merkle_node &reply);
+
+void fetch_chat_history(messenger::chat *chat_inst,
+                        std::shared_ptr<ip::tcp::socket> ptr, uint64_t pos);
+
+// writes a digest query and reads the reply, functor(shared_ptr<merkle_node>)
+// runs on its associated executor and is not called on errors
+template <typename functor>
+void query_merkle_node(std::shared_ptr<ip::tcp::socket> ptr,
+                       const std::string &chat_id, uint32_t level,
+                       uint64_t index, functor handler) {
+  network_packets::merkle_node query;
+  query.chat_id = chat_id;
+  query.level = level;
+  query.index = index;
+  auto frame = deserializer::serialize_frame(query);
+  boost::asio::async_write(
+      *ptr, boost::asio::buffer(frame.first.get(), frame.second),
+      [ptr, frame, handler](const boost::system::error_code ec, uint64_t) {
+        if (ec) {
+          return;
+        }
+        std::shared_ptr<uint64_t> len(new uint64_t(0));
+        boost::asio::async_read(
+            *ptr, boost::asio::buffer(len.get(), sizeof(*len)),
+            [ptr, len, handler](const boost::system::error_code ec, uint64_t) {
+              if (ec || *len == 0 || *len > messenger_server::max_frame_len) {
+                return;
+              }
+              std::shared_ptr<char[]> data(new char[*len]);
+              boost::asio::async_read(
+                  *ptr, boost::asio::buffer(data.get(), *len),
+                  [ptr, len, data, handler](const boost::system::error_code ec,
+                                            uint64_t) {
+                    // decoding other types may throw, e.g. on a bad rsa
+                    // key, and nothing here would catch it
+                    if (ec || deserializer::packet_type(data.get(), *len) !=
+                                  network_type::merkle_node) {
+                      return;
+                    }
+                    auto res = deserializer::deserialize(data, *len);
+                    auto reply =
+                        std::get_if<network_packets::merkle_node>(&res);
+                    if (reply != nullptr) {
+                      auto ex = boost::asio::get_associated_executor(
+                          handler, ptr->get_executor());
+                      boost::asio::post(
+                          ex, [handler,
+                               reply = std::make_shared<
+                                   network_packets::merkle_node>(
+                                   std::move(*reply))]() mutable {
+                            handler(std::move(reply));
+                          });
+                    }
+                  });
+            });
+      });
+}
 } // namespace network
 
 } // namespace messenger
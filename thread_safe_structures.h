@@ -1,27 +1,160 @@
 #ifndef THREAD_SAFE_STRUCTS_H
 #define THREAD_SAFE_STRUCTS_H
 #include "chat_info_list_fwd.h"
+#include <array>
+#include <atomic>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <optional>
+#include <shared_mutex>
+#include <thread>
 #include <utility>
 
+// copy-on-write map for read-mostly tables. Writers copy the current map
+// under mutex_d and publish the copy through an atomic pointer. Readers
+// take no lock: they mark themselves in a per-thread stripe of the current
+// epoch's counters, read the published map and leave. A writer flips the
+// epoch and frees the replaced version once the old epoch's counters drain,
+// so readers on different threads share no cache line.
 template <typename key_t_arg, typename val_t_arg> class thread_safe_map {
 public:
+  using map_type = std::map<key_t_arg, val_t_arg>;
+
+  thread_safe_map()
+      : current(new version{std::make_shared<const map_type>()}) {}
+
+  thread_safe_map(const thread_safe_map &) = delete;
+  thread_safe_map &operator=(const thread_safe_map &) = delete;
+
+  ~thread_safe_map() { delete current.load(); }
+
   template <typename... construct_args>
   void add(const key_t_arg &key, construct_args &&...args) {
     std::unique_lock ul{mutex_d};
-    map_d.emplace(key, std::forward<construct_args>(args)...);
+    auto next = std::make_shared<map_type>(*current.load()->map);
+    next->emplace(key, std::forward<construct_args>(args)...);
+    auto old = current.exchange(new version{std::move(next)});
+    // readers that can still see old counted themselves in this epoch
+    uint64_t e = epoch.load();
+    epoch.store(e + 1);
+    while (readers_in(e & 1) != 0) {
+      std::this_thread::yield();
+    }
+    delete old;
   }
 
-  val_t_arg get(const key_t_arg &key) {
-    std::unique_lock ul{mutex_d};
-    return map_d[key];
+  std::optional<val_t_arg> find(const key_t_arg &key) const {
+    read_guard guard(*this);
+    auto &m = *guard.get()->map;
+    auto it = m.find(key);
+    if (it == m.end()) {
+      return std::nullopt;
+    }
+    return it->second;
+  }
+
+  // default constructed value on a miss, nothing is inserted
+  val_t_arg get(const key_t_arg &key) const {
+    auto res = find(key);
+    return res ? std::move(*res) : val_t_arg();
+  }
+
+  // the map stays valid while the pointer is held, copying it touches the
+  // shared reference count, so lookups should use find
+  std::shared_ptr<const map_type> snapshot() const {
+    read_guard guard(*this);
+    return guard.get()->map;
   }
 
 private:
-  std::map<key_t_arg, val_t_arg> map_d;
+  static constexpr size_t stripes = 16;
+
+  struct version {
+    std::shared_ptr<const map_type> map;
+  };
+
+  struct alignas(64) stripe {
+    std::atomic<int64_t> count{0};
+  };
+
+  class read_guard {
+  public:
+    explicit read_guard(const thread_safe_map &m) : owner(m) {
+      size_t slot = stripe_index();
+      for (;;) {
+        uint64_t e = owner.epoch.load();
+        counter = &owner.readers[e & 1][slot].count;
+        counter->fetch_add(1);
+        if (owner.epoch.load() == e) {
+          break;
+        }
+        counter->fetch_sub(1);
+      }
+    }
+
+    ~read_guard() { counter->fetch_sub(1, std::memory_order_release); }
+
+    const version *get() const { return owner.current.load(); }
+
+  private:
+    const thread_safe_map &owner;
+    std::atomic<int64_t> *counter = nullptr;
+  };
+
+  static size_t stripe_index() {
+    static std::atomic<size_t> next{0};
+    thread_local size_t index = next++ % stripes;
+    return index;
+  }
+
+  int64_t readers_in(uint64_t parity) const {
+    int64_t res = 0;
+    for (auto &i : readers[parity]) {
+      res += i.count.load();
+    }
+    return res;
+  }
+
+  std::atomic<version *> current;
+  std::atomic<uint64_t> epoch{0};
+  mutable std::array<std::array<stripe, stripes>, 2> readers;
   std::mutex mutex_d;
 };
 
+// map split into shard_count independently locked shards by key hash.
+// Elements are never erased, so pointers returned by add and find stay valid.
+template <typename key_t_arg, typename val_t_arg, size_t shard_count = 16>
+class sharded_registry {
+public:
+  // constructs the value in place, the existing value if key is taken
+  template <typename... construct_args>
+  val_t_arg &add(const key_t_arg &key, construct_args &&...args) {
+    auto &s = shard_for(key);
+    std::unique_lock ul{s.mutex_d};
+    return s.map_d.try_emplace(key, std::forward<construct_args>(args)...)
+        .first->second;
+  }
+
+  val_t_arg *find(const key_t_arg &key) {
+    auto &s = shard_for(key);
+    std::shared_lock sl{s.mutex_d};
+    auto it = s.map_d.find(key);
+    return it == s.map_d.end() ? nullptr : &it->second;
+  }
+
+private:
+  struct shard {
+    std::map<key_t_arg, val_t_arg> map_d;
+    std::shared_mutex mutex_d;
+  };
+
+  shard &shard_for(const key_t_arg &key) {
+    return shards[std::hash<key_t_arg>{}(key) % shard_count];
+  }
+
+  std::array<shard, shard_count> shards;
+};
+
 #endif
\ No newline at end of file